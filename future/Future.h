@@ -2,6 +2,7 @@
 #define BERT_FUTURE_H
 
 #include <atomic>
+#include <cstdint>
 #include <mutex>
 #include <functional>
 #include <type_traits>
@@ -20,6 +21,7 @@ enum class Progress {
     Timeout,
     Done,
     Retrieved,
+    Setting,    // value is being written by promise, not ready
 };
 
 using TimeoutCallback = std::function<void ()>;
@@ -31,15 +33,52 @@ struct State {  // 多线程共享变量
                   std::is_move_constructible<T>() ||
                   "must be copyable or movable or void");   // 检查类型
     State() :
-        progress_(Progress::None),
+        flags_(static_cast<uint32_t>(Progress::None)),
         retrieved_ {false} {
     
     }
-    std::mutex thenLock_;
     using ValueType = typename TryWrapper<T>::Type; //value类型
     ValueType value_;
     std::function<void (ValueType&& )> then_;   // function
-    Progress progress_;
+
+    // Lock free state word: Progress in low bits, kHasThen after then_ is set.
+    // value_ is published by Setting -> Done, then_ by kHasThen, whoever
+    // comes later calls then_, so it's called exactly once.
+    static const uint32_t kProgressMask = 0xF;
+    static const uint32_t kHasThen = 0x10;
+    std::atomic<uint32_t> flags_;
+
+    Progress GetProgress() const {
+        return static_cast<Progress>(flags_.load(std::memory_order_acquire) & kProgressMask);
+    }
+
+    // from -> to, keep kHasThen, false if progress is not from
+    bool Transit(Progress from, Progress to) {
+        uint32_t old = flags_.load(std::memory_order_relaxed);
+        do {
+            if ((old & kProgressMask) != static_cast<uint32_t>(from))
+                return false;
+        } while (!flags_.compare_exchange_weak(old,
+                                               (old & ~kProgressMask) | static_cast<uint32_t>(to),
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_relaxed));
+        return true;
+    }
+
+    // After value_ is written in Setting
+    void Publish() {
+        const uint32_t flip = static_cast<uint32_t>(Progress::Setting) ^ static_cast<uint32_t>(Progress::Done);
+        const uint32_t old = flags_.fetch_xor(flip, std::memory_order_acq_rel);
+        if (old & kHasThen)
+            then_(std::move(value_));
+    }
+
+    void SetThen(std::function<void (ValueType&& )>&& func) {
+        then_ = std::move(func);
+        const uint32_t old = flags_.fetch_or(kHasThen, std::memory_order_acq_rel);
+        if ((old & kProgressMask) == static_cast<uint32_t>(Progress::Done))
+            then_(std::move(value_)); // promise didn't see then_
+    }
 
     std::function<void (TimeoutCallback&& )> onTimeout_;
     std::atomic<bool> retrieved_;
@@ -69,53 +108,35 @@ public:
     Promise& operator= (Promise&& pm) = default;
 
     void SetException(std::exception_ptr exp) {
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        if (state_->progress_ != Progress::None)
+        if (!state_->Transit(Progress::None, Progress::Setting))
             return;
 
-        state_->progress_ = Progress::Done;
         state_->value_ = typename State<T>::ValueType(std::move(exp));
-        guard.unlock();
-
-        if (state_->then_)
-            state_->then_(std::move(state_->value_));
+        state_->Publish();
     }
 
     template <typename SHIT = T>
     typename std::enable_if<!std::is_void<SHIT>::value, void>::type // SHIT不是void类型
     SetValue(SHIT&& t) {    // t参数一般是执行的函数类型
-        // If ThenImp is running, here will wait for the lock.
-        // After set then_, ThenImp will release lock.
-        // And this func got lock, definitely will call then_.
-        std::unique_lock<std::mutex> guard(state_->thenLock_);  // 设置值到共享变量中, 要上锁
-        if (state_->progress_ != Progress::None)
+        // Only one of SetValue/SetException/timeout can leave None.
+        if (!state_->Transit(Progress::None, Progress::Setting))
             return;
 
-        state_->progress_ = Progress::Done;
         state_->value_ = std::forward<SHIT>(t); // value
 
-        guard.unlock();
-
-        // When reach here, state_ is determined, so mutex is useless
-        // If the ThenImp function run, it'll see the Done state and
-        // call user func there, not assign to then_.
-        if (state_->then_)
-            state_->then_(std::move(state_->value_));   // 执行state_->value函数
+        // If then_ is set already, call it here; otherwise
+        // ThenImp will see the Done state and call user func there.
+        state_->Publish();
     }
 
     template <typename SHIT = T>
     typename std::enable_if<std::is_void<SHIT>::value, void>::type
     SetValue() {
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        if (state_->progress_ != Progress::None)
+        if (!state_->Transit(Progress::None, Progress::Setting))
             return;
 
-        state_->progress_ = Progress::Done;
         state_->value_ = Try<void>();
-
-        guard.unlock();
-        if (state_->then_)
-            state_->then_(std::move(state_->value_));
+        state_->Publish();
     }
 
     Future<T> GetFuture() { // 返回Future对象
@@ -128,7 +149,8 @@ public:
     }
 
     bool IsReady() const {
-        return state_->progress_ != Progress::None;
+        const Progress progress = state_->GetProgress();
+        return progress != Progress::None && progress != Progress::Setting;
     }
 
 private:
@@ -170,22 +192,22 @@ public:
     typename State<T>::ValueType
     Wait(const std::chrono::milliseconds& timeout = std::chrono::milliseconds(24*3600*1000)) {
 
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        switch (state_->progress_) {
+        switch (state_->GetProgress()) {
             case Progress::None:
+            case Progress::Setting:
                 break;
 
             case Progress::Timeout:
                 throw std::runtime_error("Future timeout");
 
             case Progress::Done:
-                state_->progress_ = Progress::Retrieved;
+                if (!state_->Transit(Progress::Done, Progress::Retrieved))
+                    throw std::runtime_error("Future already retrieved");
                 return std::move(state_->value_);
 
             default:
                 throw std::runtime_error("Future already retrieved");
         }
-        guard.unlock();
 
         auto cond(std::make_shared<std::condition_variable>());
         auto mutex(std::make_shared<std::mutex>());
@@ -225,10 +247,10 @@ public:
         Promise<InnerType> prom;
         Future<InnerType> fut = prom.GetFuture();
 
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        if (state_->progress_ == Progress::Timeout) {
+        const Progress progress = state_->GetProgress();
+        if (progress == Progress::Timeout) {
             throw std::runtime_error("Wrong state : Timeout");
-        } else if (state_->progress_ == Progress::Done) {
+        } else if (progress == Progress::Done) {
             try {
                 auto innerFuture = std::move(state_->value_);
                 return std::move(innerFuture.Value());
@@ -283,10 +305,10 @@ public:
 
         using FuncType = typename std::decay<F>::type;
 
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        if (state_->progress_ == Progress::Timeout) {
+        const Progress progress = state_->GetProgress();
+        if (progress == Progress::Timeout) {
             throw std::runtime_error("Wrong state : Timeout");
-        } else if (state_->progress_ == Progress::Done) {
+        } else if (progress == Progress::Done) {
             typename TryWrapper<T>::Type t;
             try {
                 t = std::move(state_->value_);
@@ -294,8 +316,6 @@ public:
                 t = (typename TryWrapper<T>::Type)(std::current_exception());
             }
 
-            guard.unlock();
-
             if (sched) {
                 sched->Schedule([t = std::move(t),
                                  f = std::forward<FuncType>(f),
@@ -346,10 +366,10 @@ public:
 
         using FuncType = typename std::decay<F>::type;
 
-        std::unique_lock<std::mutex> guard(state_->thenLock_);
-        if (state_->progress_ == Progress::Timeout) {
+        const Progress progress = state_->GetProgress();
+        if (progress == Progress::Timeout) {
             throw std::runtime_error("Wrong state : Timeout");
-        } else if (state_->progress_ == Progress::Done) {
+        } else if (progress == Progress::Done) {
             typename TryWrapper<T>::Type t;
             try {
                 t = std::move(state_->value_);
@@ -357,8 +377,6 @@ public:
                 t = decltype(t)(std::current_exception());
             }
 
-            guard.unlock();
-
             auto cb = [res = std::move(t),
                        f = std::forward<FuncType>(f),
                        prom = std::move(pm)]() mutable {
@@ -375,10 +393,10 @@ public:
                     return;
                 }
 
-                std::unique_lock<std::mutex> guard(innerFuture.state_->thenLock_);
-                if (innerFuture.state_->progress_ == Progress::Timeout) {
+                const Progress progress = innerFuture.state_->GetProgress();
+                if (progress == Progress::Timeout) {
                     throw std::runtime_error("Wrong state : Timeout");
-                } else if (innerFuture.state_->progress_ == Progress::Done) {
+                } else if (progress == Progress::Done) {
                     typename TryWrapper<FReturnType>::Type t;
                     try {
                         t = std::move(innerFuture.state_->value_);
@@ -386,7 +404,6 @@ public:
                         t = decltype(t)(std::current_exception());
                     }
 
-                    guard.unlock();
                     prom.SetValue(std::move(t));
                 } else {
                     innerFuture._SetCallback([prom = std::move(prom)](typename TryWrapper<FReturnType>::Type&& t) mutable {
@@ -418,10 +435,10 @@ public:
                     if (!innerFuture.valid()) {
                         return;
                     }
-                    std::unique_lock<std::mutex> guard(innerFuture.state_->thenLock_);
-                    if (innerFuture.state_->progress_ == Progress::Timeout) {
+                    const Progress progress = innerFuture.state_->GetProgress();
+                    if (progress == Progress::Timeout) {
                         throw std::runtime_error("Wrong state : Timeout");
-                    } else if (innerFuture.state_->progress_ == Progress::Done) {
+                    } else if (progress == Progress::Done) {
                         typename TryWrapper<FReturnType>::Type t;
                         try {
                             t = std::move(innerFuture.state_->value_);
@@ -429,7 +446,6 @@ public:
                             t = decltype(t)(std::current_exception());
                         }
 
-                        guard.unlock();
                         prom.SetValue(std::move(t));
                     } else {
                         innerFuture._SetCallback([prom = std::move(prom)](typename TryWrapper<FReturnType>::Type&& t) mutable {
@@ -475,20 +491,17 @@ public:
                    Scheduler* scheduler) {
 
         scheduler->ScheduleLater(duration, [state = state_, cb = std::move(f)]() mutable {
-            std::unique_lock<std::mutex> guard(state->thenLock_);
-            if (state->progress_ != Progress::None)
+            if (!state->Transit(Progress::None, Progress::Timeout))
                 return;
 
-            state->progress_ = Progress::Timeout;
-            guard.unlock();
-
             cb();
         });
     }
 
 private:
+    // If promise is done meanwhile, func is called here
     void _SetCallback(std::function<void (typename TryWrapper<T>::Type&& )>&& func) {
-        state_->then_ = std::move(func);
+        state_->SetThen(std::move(func));
     }
 
     void _SetOnTimeout(std::function<void (TimeoutCallback&& )>&& func) {
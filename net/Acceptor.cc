@@ -1,5 +1,7 @@
 #include <errno.h>
+#include <algorithm>
 #include <cassert>
+#include <iterator>
 #include "EventLoop.h"
 #include "Application.h"
 #include "Connection.h"
@@ -29,6 +31,11 @@ void Acceptor::SetNewConnCallback(NewTcpConnCallback cb) {
     newConnCallback_ = std::move(cb);   // 设置连接回调函数
 }
 
+void Acceptor::SetReusePort(bool reuse) {
+    assert (localSock_ == kInvalid);
+    reusePort_ = reuse;
+}
+
 // 创建socketfd. 绑定地址并监听
 bool Acceptor::Bind(const SocketAddr& addr) {   // 事实是创建一个socket并绑定addr
     if (!addr.IsValid())
@@ -48,6 +55,8 @@ bool Acceptor::Bind(const SocketAddr& addr) {   // 事实是创建一个socket
     SetNonBlock(localSock_);    // 设置fd一些特性
     SetNodelay(localSock_);
     SetReuseAddr(localSock_);
+    if (reusePort_)
+        ananas::SetReusePort(localSock_);
     SetRcvBuf(localSock_);
     SetSndBuf(localSock_);
 
@@ -78,68 +87,144 @@ int Acceptor::Identifier() const {
 }
 
 bool Acceptor::HandleReadEvent() {  // 处理可读回调函数,新连接到来eventloop响应自动调用该函数。先用传入connfd封装新连接connection, 再将connection注册到poller, 最后执行onConnect回调函数
-    while (true) {
-        int connfd = _Accept(); // 执行accept获得connfd
+    // Accept at most budget connections, so one listener can not starve the loop
+    const std::size_t budget = loop_->AcceptBudget();
+    std::size_t accepted = 0;
+    bool succ = true;
+    bool more = true;
+
+    while (more && accepted < budget) {
+        SocketAddr peer;
+        const int connfd = _Accept(peer); // 执行accept获得connfd
         if (connfd != kInvalid) {   // connfd有效
-            auto loop = Application::Instance().Next(); // 获取Application的下一个有效的eventloop, 操作loop间接操作线程
-
-            auto func = [loop, newCb = newConnCallback_, connfd, peer = peer_]() {
-                auto conn(std::make_shared<Connection>(loop));  // 基于loop创建connection对象 conn
-                conn->Init(connfd, peer);   // 用connfd初始化conn
-
-                if (loop->Register(eET_Read, conn)) {   // 注册新连接到Poll
-                    newCb(conn.get());  // conn.get()返回内部裸指针, 构造NewTcpConnCallback回调
-                    conn->_OnConnect(); // conn执行_OnConnect()回调函数
-                } else {
-                    ANANAS_ERR << "Failed to register socket " << conn->Identifier();
-                }
-            };
-            // 执行func
-            loop->Execute(std::move(func));
-        } else {    // 接受连接失败, 错误处理
-            bool goAhead = false;
-            const int error = errno;
-            switch (error) {
-            //case EWOULDBLOCK:
-            case EAGAIN:
-                return true; // it's fine
-
-            case EINTR:
-            case ECONNABORTED:
-            case EPROTO:
-                goAhead = true; // should retry
-                break;
-
-            case EMFILE:
-            case ENFILE:
-                ANANAS_ERR << "Not enough file descriptor available, error is "
-                           << error
-                           << ", CPU may 100%";
-                return true;
-
-            case ENOBUFS:
-            case ENOMEM:
-                ANANAS_ERR << "Not enough memory, limited by the socket buffer limits"
-                           << ", CPU may 100%";
-                return true;
-
-            case ENOTSOCK:
-            case EOPNOTSUPP:
-            case EINVAL:
-            case EFAULT:
-            case EBADF:
-            default:
-                ANANAS_ERR << "BUG: error = " << error;
-                assert (false);
-                break;
-            }
-
-            if (!goAhead)
-                return false;
+            ++ accepted;
+
+            // With SO_REUSEPORT, kernel has chosen me, accept locally
+            auto loop = reusePort_ ? loop_ : _ChooseLoop(connfd, peer); // 获取Application的下一个有效的eventloop, 操作loop间接操作线程
+            if (loop->InThisLoop())
+                _NewConnection(loop, connfd, peer, newConnCallback_);
+            else
+                pending_.push_back({loop, connfd, peer});   // hand over later in batch
+
+            continue;
+        }
+
+        // 接受连接失败, 错误处理
+        const int error = errno;
+        switch (error) {
+        //case EWOULDBLOCK:
+        case EAGAIN:
+            more = false; // it's fine
+            break;
+
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+            break; // should retry
+
+        case EMFILE:
+        case ENFILE:
+            ANANAS_ERR << "Not enough file descriptor available, error is "
+                       << error
+                       << ", CPU may 100%";
+            more = false;
+            break;
+
+        case ENOBUFS:
+        case ENOMEM:
+            ANANAS_ERR << "Not enough memory, limited by the socket buffer limits"
+                       << ", CPU may 100%";
+            more = false;
+            break;
+
+        case ENOTSOCK:
+        case EOPNOTSUPP:
+        case EINVAL:
+        case EFAULT:
+        case EBADF:
+        default:
+            ANANAS_ERR << "BUG: error = " << error;
+            assert (false);
+            more = false;
+            succ = false;
+            break;
         }
     }
 
-    return true;
+    _HandOver();
+
+    // Budget is used up, there may be more connections in backlog.
+    // Edge triggered poller will not tell us again, so continue later.
+    if (more && succ)
+        _ContinueLater();
+
+    return succ;
+}
+
+EventLoop* Acceptor::_ChooseLoop(int connfd, const SocketAddr& peer) const {
+    auto& app = Application::Instance();
+    if (app.MatchIncomingCpu()) {
+        // the cpu which handled its packets, caches are hot there
+        if (auto loop = app.LoopOfCpu(GetIncomingCpu(connfd)))
+            return loop;
+    }
+
+    return app.Next(peer);
+}
+
+void Acceptor::_HandOver() {
+    // one Execute for each target loop, not each connection
+    while (!pending_.empty()) {
+        EventLoop* loop = pending_.front().loop;
+        auto it = std::stable_partition(pending_.begin(), pending_.end(),
+                                        [loop](const Pending& p) {
+                                            return p.loop != loop;
+                                        });
+
+        std::vector<Pending> batch(std::make_move_iterator(it),
+                                   std::make_move_iterator(pending_.end()));
+        pending_.erase(it, pending_.end());
+
+        auto func = [batch = std::move(batch), newCb = newConnCallback_]() {
+            for (const auto& p : batch)
+                _NewConnection(p.loop, p.fd, p.peer, newCb);
+        };
+
+        loop->Execute(std::move(func));
+    }
+}
+
+void Acceptor::_ContinueLater() {
+    if (continuing_)
+        return;
+
+    // timers are updated after fired events, other channels go first
+    continuing_ = true;
+    auto self = shared_from_this();
+    loop_->ScheduleAfter(std::chrono::milliseconds(0), [this, self]() {
+        continuing_ = false;
+        if (!HandleReadEvent())
+            HandleErrorEvent();
+    });
+}
+
+void Acceptor::_NewConnection(EventLoop* loop,
+                              int connfd,
+                              const SocketAddr& peer,
+                              const NewTcpConnCallback& newCb) {
+    assert (loop->InThisLoop());
+
+    auto conn(std::make_shared<Connection>(loop));  // 基于loop创建connection对象 conn
+    conn->Init(connfd, peer);   // 用connfd初始化conn
+    if (loop->SockBusyPoll())
+        SetBusyPoll(connfd, static_cast<int>(loop->BusyPollBudget().count()));
+
+    if (loop->Register(eET_Read, conn)) {   // 注册新连接到Poll
+        newCb(conn.get());  // conn.get()返回内部裸指针, 构造NewTcpConnCallback回调
+        conn->_OnConnect(); // conn执行_OnConnect()回调函数
+    } else {
+        ANANAS_ERR << "Failed to register socket " << conn->Identifier();
+    }
 }
 
 bool Acceptor::HandleWriteEvent() {
@@ -152,9 +237,23 @@ void Acceptor::HandleErrorEvent() {
     loop_->Unregister(eET_Read, shared_from_this());
 }
 
-int Acceptor::_Accept() {   // server的accept, 返回connfd
-    socklen_t addrLength = sizeof peer_;
-    return ::accept(localSock_, (struct sockaddr *)&peer_, &addrLength);
+int Acceptor::_Accept(SocketAddr& peer) {   // server的accept, 返回connfd
+    sockaddr_in addr;
+    socklen_t addrLength = sizeof addr;
+#if defined(__gnu_linux__)
+    // no more fcntl for each connection
+    int connfd = ::accept4(localSock_, (struct sockaddr *)&addr, &addrLength,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int connfd = ::accept(localSock_, (struct sockaddr *)&addr, &addrLength);
+    if (connfd != kInvalid)
+        SetNonBlock(connfd);
+#endif
+
+    if (connfd != kInvalid)
+        peer.Init(addr);
+
+    return connfd;
 }
 
 } // namespace internal
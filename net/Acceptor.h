@@ -2,6 +2,7 @@
 #ifndef BERT_ACCEPTOR_H
 #define BERT_ACCEPTOR_H
 
+#include <vector>
 #include "Socket.h"
 #include "Typedefs.h"
 
@@ -17,6 +18,8 @@ public:
     void operator= (const Acceptor& ) = delete;
 
     void SetNewConnCallback(NewTcpConnCallback cb); // 设置连接回调函数
+    ///@brief Listen with SO_REUSEPORT and accept into this loop, call it before Bind
+    void SetReusePort(bool reuse);
     bool Bind(const SocketAddr& addr);  // 绑定地址addr
 
     int Identifier() const override;    // 返回acceptor建立的sockfd
@@ -26,11 +29,28 @@ public:
     void HandleErrorEvent() override;
 
 private:
-    int _Accept();
+    int _Accept(SocketAddr& peer);
+    EventLoop* _ChooseLoop(int connfd, const SocketAddr& peer) const;
+    void _HandOver();
+    void _ContinueLater();
+
+    static void _NewConnection(EventLoop* loop,
+                               int connfd,
+                               const SocketAddr& peer,
+                               const NewTcpConnCallback& newCb);
+
+    // connections accepted for other loops in this wakeup
+    struct Pending {
+        EventLoop* loop;
+        int fd;
+        SocketAddr peer;
+    };
+    std::vector<Pending> pending_;
+    bool continuing_ {false};
 
-    SocketAddr peer_;
     int localSock_;
     uint16_t localPort_;    // 本地端口
+    bool reusePort_ {false};
 
     EventLoop* const loop_; // which loop belong to
 
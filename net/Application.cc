@@ -1,16 +1,21 @@
 
 #include <signal.h>
+#include <cerrno>
 #include <cstring>
 #include <cstdio>
 
 #include <memory>
 #include <mutex>
+#include <random>
+#include <thread>
 #include <condition_variable>
 
 #include "util/Util.h"
+#include "util/Affinity.h"
 #include "Application.h"
 #include "AnanasLogo.h"
 #include "Socket.h"
+#include "DatagramSocket.h"
 #include "AnanasDebug.h"
 
 static void SignalHandler(int num) {
@@ -52,6 +57,98 @@ size_t Application::NumOfWorker() const {
     return 1 + numLoop_;
 }
 
+void Application::SetPollerType(PollerType type) {
+    assert (state_ == State::eS_None);
+
+    pollerType_ = type;
+    base_.SetPollerType(type);
+}
+
+void Application::SetEdgeTriggered(bool et) {
+    assert (state_ == State::eS_None);
+
+    edgeTriggered_ = et;
+    base_.SetEdgeTriggered(et);
+}
+
+void Application::SetTimerMode(TimerMode mode) {
+    assert (state_ == State::eS_None);
+
+    timerMode_ = mode;
+    base_.SetTimerMode(mode);
+}
+
+void Application::SetHighResolutionTimer(bool enable) {
+    assert (state_ == State::eS_None);
+
+    highResTimer_ = enable;
+    base_.SetHighResolutionTimer(enable);
+}
+
+void Application::SetReusePort(bool reuse) {
+    assert (state_ == State::eS_None);
+
+    reusePort_ = reuse;
+}
+
+void Application::SetUdpReusePort(bool reuse, UdpSteering steering) {
+    assert (state_ == State::eS_None);
+
+    udpReusePort_ = reuse;
+    udpSteering_ = steering;
+}
+
+void Application::SetAcceptBudget(std::size_t budget) {
+    assert (state_ == State::eS_None);
+
+    acceptBudget_ = budget;
+    base_.SetAcceptBudget(budget);
+}
+
+void Application::SetDeferredFlush(bool enable) {
+    assert (state_ == State::eS_None);
+
+    deferredFlush_ = enable;
+    base_.SetDeferredFlush(enable);
+}
+
+void Application::SetLoadBalance(LoadBalance lb) {
+    assert (state_ == State::eS_None);
+
+    loadBalance_ = lb;
+}
+
+void Application::SetCpuAffinity(std::vector<int> cpus) {
+    assert (state_ == State::eS_None);
+
+    pinned_ = !cpus.empty();
+    pool_.SetCpuAffinity(std::move(cpus));
+}
+
+void Application::SetMatchIncomingCpu(bool match) {
+    assert (state_ == State::eS_None);
+
+    matchIncomingCpu_ = match;
+}
+
+EventLoop* Application::LoopOfCpu(int cpu) const {
+    if (state_ != State::eS_Started)
+        return nullptr;
+
+    if (cpu < 0 || static_cast<std::size_t>(cpu) >= cpuLoops_.size())
+        return nullptr;
+
+    return cpuLoops_[cpu];
+}
+
+void Application::SetBusyPoll(std::chrono::microseconds budget, bool sockBusyPoll) {
+    assert (state_ == State::eS_None);
+
+    busyPollBudget_ = budget;
+    sockBusyPoll_ = sockBusyPoll;
+    base_.SetBusyPoll(budget, sockBusyPoll);
+}
+
 // 之前已经实现了sockfd的创建绑定和监听
 void Application::Run(int ac, char* av[]) { // 运行server
     ANANAS_DEFER {
@@ -74,6 +171,15 @@ void Application::Run(int ac, char* av[]) { // 运行server
 
     // start loops in thread pool, 在子线程中创建loop对象, 指针加入Loop队列
     _StartWorkers();    // 创建线程池的线程
+
+    for (auto& pl : pendingListens_)
+        _ListenReusePort(pl.addr, std::move(pl.cb), std::move(pl.bfcb));
+    pendingListens_.clear();
+
+    for (auto& pl : pendingUDPListens_)
+        _ListenUDPReusePort(pl.addr, std::move(pl.mcb), std::move(pl.ccb), std::move(pl.bfcb));
+    pendingUDPListens_.clear();
+
     BaseLoop()->Run();  // 主线程执行loop()事件循环
 
     printf("Stopped BaseEventLoop...\n");
@@ -85,10 +191,20 @@ void Application::Run(int ac, char* av[]) { // 运行server
 }
 
 void Application::Exit() {
-    if (state_ == State::eS_Stopped)
+    const State old = state_.exchange(State::eS_Stopped);
+    if (old == State::eS_Stopped)
         return;
 
-    state_ = State::eS_Stopped;
+    // Loops may wait forever if there is no timer.
+    // Wakeup only writes eventfd, it's safe in signal handler
+    base_.Wakeup();
+    if (old == State::eS_Started)
+        _WakeupWorkers();
+}
+
+void Application::_WakeupWorkers() {
+    for (auto& loop : loops_)
+        loop->Wakeup();
 }
 
 bool Application::IsExit() const {
@@ -111,6 +227,15 @@ void Application::SetOnExit(std::function<void ()> onexit) {
 void Application::Listen(const SocketAddr& listenAddr,
                          NewTcpConnCallback cb,
                          BindCallback bfcb) {
+    if (reusePort_) {
+        if (state_ == State::eS_None)
+            pendingListens_.push_back({listenAddr, std::move(cb), std::move(bfcb)});
+        else
+            _ListenReusePort(listenAddr, std::move(cb), std::move(bfcb));
+
+        return;
+    }
+
     auto loop = BaseLoop();
     loop->Execute([loop, listenAddr, cb, bfcb]() {  
         if (!loop->Listen(listenAddr, std::move(cb)))   // 执行了create, bind, listen
@@ -120,6 +245,41 @@ void Application::Listen(const SocketAddr& listenAddr,
     });
 }
 
+void Application::_ListenReusePort(const SocketAddr& listenAddr,
+                                   NewTcpConnCallback cb,
+                                   BindCallback bfcb) {
+    std::vector<EventLoop*> loops;
+    for (const auto& loop : loops_)
+        loops.push_back(loop.get());
+
+    if (loops.empty())
+        loops.push_back(BaseLoop());
+
+    // bfcb is called once in base loop, succ only if all workers listen succ
+    struct Result {
+        std::atomic<size_t> left;
+        std::atomic<bool> succ;
+    };
+    auto result = std::make_shared<Result>();
+    result->left = loops.size();
+    result->succ = true;
+
+    auto base = BaseLoop();
+    for (auto loop : loops) {
+        loop->Execute([loop, base, listenAddr, cb, bfcb, result]() {
+            if (!loop->Listen(listenAddr, cb, true))
+                result->succ = false;
+
+            if (-- result->left == 0) {
+                const bool succ = result->succ;
+                base->Execute([listenAddr, bfcb, succ]() {
+                    bfcb(succ, listenAddr);
+                });
+            }
+        });
+    }
+}
+
 void Application::Listen(const char* ip,
                          uint16_t hostPort,
                          NewTcpConnCallback cb, // 设置了NewTcpConnCallback, 参数为void (Connection* )
@@ -132,6 +292,15 @@ void Application::ListenUDP(const SocketAddr& addr,
                             UDPMessageCallback mcb,
                             UDPCreateCallback ccb,
                             BindCallback bfcb) {
+    if (udpReusePort_) {
+        if (state_ == State::eS_None)
+            pendingUDPListens_.push_back({addr, std::move(mcb), std::move(ccb), std::move(bfcb)});
+        else
+            _ListenUDPReusePort(addr, std::move(mcb), std::move(ccb), std::move(bfcb));
+
+        return;
+    }
+
     auto loop = BaseLoop();
     loop->Execute([loop, addr, mcb, ccb, bfcb]() {
         if (!loop->ListenUDP(addr, std::move(mcb), std::move(ccb)))
@@ -141,6 +310,116 @@ void Application::ListenUDP(const SocketAddr& addr,
     });
 }
 
+struct Application::UdpShard {
+    SocketAddr addr;
+    UDPMessageCallback mcb;
+    UDPCreateCallback ccb;
+    BindCallback bfcb;
+    EventLoop* base;
+    std::vector<EventLoop*> loops;
+    UdpSteering steering;
+    std::vector<int> indexOfCpu;
+    std::vector<std::weak_ptr<DatagramSocket>> sockets;
+};
+
+void Application::_ListenUDPReusePort(const SocketAddr& listenAddr,
+                                      UDPMessageCallback mcb,
+                                      UDPCreateCallback ccb,
+                                      BindCallback bfcb) {
+    auto shard = std::make_shared<UdpShard>();
+    shard->addr = listenAddr;
+    shard->mcb = std::move(mcb);
+    shard->ccb = std::move(ccb);
+    shard->bfcb = std::move(bfcb);
+    shard->base = BaseLoop();
+    shard->steering = udpSteering_;
+
+    for (const auto& loop : loops_)
+        shard->loops.push_back(loop.get());
+
+    if (shard->loops.empty())
+        shard->loops.push_back(BaseLoop());
+
+    shard->sockets.resize(shard->loops.size());
+
+    // cpu of pinned loop -> its socket index, others use cpu % count
+    for (std::size_t cpu = 0; cpu < cpuLoops_.size(); ++ cpu) {
+        int index = -1;
+        for (std::size_t i = 0; i < shard->loops.size(); ++ i) {
+            if (cpuLoops_[cpu] && cpuLoops_[cpu] == shard->loops[i]) {
+                index = static_cast<int>(i);
+                break;
+            }
+        }
+
+        shard->indexOfCpu.push_back(index);
+    }
+
+    _BindUdpShard(std::move(shard), 0);
+}
+
+void Application::_AttachUdpSteering(const UdpShard& shard, int sock) {
+    const std::size_t count = shard.loops.size();
+    bool succ = false;
+    switch (shard.steering) {
+    case UdpSteering::eUS_Cpu:
+        succ = AttachReusePortCpu(sock, shard.indexOfCpu, count);
+        break;
+
+    case UdpSteering::eUS_HashPeer:
+        succ = AttachReusePortPeerHash(sock, count);
+        break;
+
+    default:
+        return;
+    }
+
+    if (!succ)
+        ANANAS_WRN << "Attach udp steering failed, errno " << errno << ", use kernel hash";
+}
+
+void Application::_BindUdpShard(std::shared_ptr<UdpShard> shard, std::size_t i) {
+    EventLoop* loop = shard->loops[i];
+    loop->Execute([shard, loop, i]() {
+        UDPCreateCallback ccb = [shard, i](DatagramSocket* s) {
+            shard->sockets[i] = std::static_pointer_cast<DatagramSocket>(s->shared_from_this());
+            // attach to one socket is enough for the whole group
+            if (i == 0 && shard->steering != UdpSteering::eUS_Kernel)
+                _AttachUdpSteering(*shard, s->Identifier());
+            if (shard->ccb)
+                shard->ccb(s);
+        };
+
+        if (!loop->ListenUDP(shard->addr, shard->mcb, std::move(ccb), true)) {
+            // later sockets would shift their index in group, give up all
+            ANANAS_ERR << "Bind udp shard " << i << " failed, close " << i << " bound sockets";
+            _CloseUdpShard(shard, i);
+            shard->base->Execute([shard]() {
+                shard->bfcb(false, shard->addr);
+            });
+            return;
+        }
+
+        if (i + 1 < shard->loops.size()) {
+            _BindUdpShard(shard, i + 1);
+        } else {
+            shard->base->Execute([shard]() {
+                shard->bfcb(true, shard->addr);
+            });
+        }
+    });
+}
+
+void Application::_CloseUdpShard(std::shared_ptr<UdpShard> shard, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++ i) {
+        EventLoop* loop = shard->loops[i];
+        loop->Execute([shard, loop, i]() {
+            if (auto s = shard->sockets[i].lock())
+                loop->Unregister(internal::eET_Read | internal::eET_Write, s);
+        });
+    }
+}
+
 void Application::ListenUDP(const char* ip, uint16_t hostPort,
                             UDPMessageCallback mcb,
                             UDPCreateCallback ccb,
@@ -190,10 +469,77 @@ EventLoop* Application::Next() {    // 获取全局loops列表的下一个可用
     if (loops_.empty())
         return BaseLoop();
 
+    switch (loadBalance_) {
+    case LoadBalance::eLB_LeastConn:
+        return _LeastConn();
+
+    case LoadBalance::eLB_PowerOfTwo:
+        return _PowerOfTwo();
+
+    case LoadBalance::eLB_RoundRobin:
+    case LoadBalance::eLB_HashPeer: // no peer, fall back to round robin
+    default:
+        break;
+    }
+
     auto& loop = loops_[currentLoop_++ % loops_.size()];
     return loop.get();
 }
 
+EventLoop* Application::Next(const SocketAddr& peer) {
+    if (loadBalance_ != LoadBalance::eLB_HashPeer ||
+        state_ != State::eS_Started ||
+        loops_.empty() ||
+        !peer.IsValid())
+        return Next();
+
+    // ip only, a client usually connects from many ports.
+    // Mix bits, hosts of a subnet only differ in low bits.
+    const uint64_t ip = ntohl(peer.GetAddr().sin_addr.s_addr);
+    const uint64_t h = (ip * 0x9E3779B97F4A7C15ULL) >> 32;
+    return loops_[h % loops_.size()].get();
+}
+
+EventLoop* Application::_LeastConn() const {
+    // Size() is atomic, it's fine to be a little stale.
+    // Scan from a rotating start, so a burst of ties is spread round robin.
+    const std::size_t n = loops_.size();
+    const std::size_t start = currentLoop_++;
+    EventLoop* best = loops_[start % n].get();
+    std::size_t least = best->Size();
+    for (std::size_t i = 1; i < n; ++ i) {
+        EventLoop* loop = loops_[(start + i) % n].get();
+        const std::size_t size = loop->Size();
+        if (size < least) {
+            least = size;
+            best = loop;
+        }
+    }
+
+    return best;
+}
+
+EventLoop* Application::_PowerOfTwo() const {
+    const std::size_t n = loops_.size();
+    if (n == 1)
+        return loops_[0].get();
+
+    // Next may be called by any loop thread
+    thread_local std::minstd_rand rand(static_cast<unsigned int>(
+        std::hash<std::thread::id>()(std::this_thread::get_id())));
+
+    const std::size_t i = rand() % n;
+    const std::size_t j = (i + 1 + rand() % (n - 1)) % n; // j != i
+
+    EventLoop* a = loops_[i].get();
+    EventLoop* b = loops_[j].get();
+    const unsigned int la = a->Load(), lb = b->Load();
+    if (la != lb)
+        return la < lb ? a : b;
+
+    return a->Size() <= b->Size() ? a : b;
+}
+
 void Application::_StartWorkers() {
     // only called by main thread
     assert (state_ == State::eS_None);
@@ -205,12 +551,27 @@ void Application::_StartWorkers() {
     for (size_t i = 0; i < numLoop_; ++i) {
         // 线程池里的线程执行, 1.创建loop 2.将loop指针加入全局变量Application.loops列表
         pool_.Execute([this, &mutex, &cond]() {
-            EventLoop* loop(new EventLoop);
+            EventLoop* loop(new EventLoop(pollerType_));
+            loop->SetEdgeTriggered(edgeTriggered_);
+            loop->SetTimerMode(timerMode_);
+            loop->SetHighResolutionTimer(highResTimer_);
+            loop->SetBusyPoll(busyPollBudget_, sockBusyPoll_);
+            loop->SetAcceptBudget(acceptBudget_);
+            loop->SetDeferredFlush(deferredFlush_);
+
+            // pool thread is pinned already
+            const int cpu = pinned_ ? CurrentCpu() : -1;
 
             {
                 std::unique_lock<std::mutex> guard(mutex);
                 // 这里的loops_是共享对象
                 loops_.push_back(std::unique_ptr<EventLoop>(loop));
+                if (cpu >= 0) {
+                    if (static_cast<std::size_t>(cpu) >= cpuLoops_.size())
+                        cpuLoops_.resize(cpu + 1, nullptr);
+                    if (!cpuLoops_[cpu])
+                        cpuLoops_[cpu] = loop;
+                }
                 // loops_线程池的对象均已创建唤醒主线程返回 
                 if (loops_.size() == numLoop_)
                     cond.notify_one();  // 唤醒等待的线程(main线程)
@@ -225,7 +586,11 @@ void Application::_StartWorkers() {
         return loops_.size() == numLoop_;   // 等待子线程创建完毕
     });
 
-    state_ = State::eS_Started;
+    State expected = State::eS_None;
+    if (!state_.compare_exchange_strong(expected, State::eS_Started)) {
+        // Exit is called while starting workers
+        _WakeupWorkers();
+    }
 }
 
 Application::Application() :    // 构造函数
@@ -9,6 +9,7 @@
 #include "EventLoop.h"
 #include "Typedefs.h"
 #include "Poller.h"
+#include "Socket.h"
 #include "ananas/util/Timer.h"
 #include "ananas/util/ThreadPool.h"
 
@@ -16,6 +17,21 @@
 namespace ananas {
 /// @file Application.h
 
+///@brief How Application::Next chooses a worker loop
+enum class LoadBalance {
+    eLB_RoundRobin, // default
+    eLB_LeastConn,  // the loop with fewest channels
+    eLB_PowerOfTwo, // the less busy one of two random loops, see EventLoop::Load
+    eLB_HashPeer,   // same peer ip always goes to same loop
+};
+
+///@brief How packets are steered between workers' UDP sockets, see SetUdpReusePort
+enum class UdpSteering {
+    eUS_Kernel,     // default, kernel hashes the 4-tuple
+    eUS_Cpu,        // the worker pinned on the cpu received packet, by classic BPF
+    eUS_HashPeer,   // same peer ip always goes to same worker, by classic BPF
+};
+
 ///@brief Abstract for a process.
 ///
 /// It's the app template class, should be singleton.
@@ -125,15 +141,84 @@ public:
 
     ///@brief Return EventLoop by some load balance
     EventLoop* Next();
+    ///@brief Return EventLoop for a new connection from peer
+    ///
+    /// Same as Next() unless load balance is eLB_HashPeer
+    EventLoop* Next(const SocketAddr& peer);
+    ///@brief Set load balance strategy of Next, must be called before Run
+    void SetLoadBalance(LoadBalance lb);
+    ///@brief Pin worker loops to cpus, must be called before Run
+    ///
+    /// The i-th worker runs on cpus[i % cpus.size()], its memory comes
+    /// from local NUMA node. Base loop is not pinned.
+    ///@param cpus Cpu ids, see ParseCpuList
+    void SetCpuAffinity(std::vector<int> cpus);
+    ///@brief Put accepted connection to the loop pinned on its SO_INCOMING_CPU
+    ///
+    /// Only valid with SetCpuAffinity, must be called before Run.
+    /// If no loop is on that cpu, fall back to Next.
+    void SetMatchIncomingCpu(bool match);
+    bool MatchIncomingCpu() const {
+        return matchIncomingCpu_;
+    }
+    ///@brief The worker loop pinned on cpu, nullptr if none
+    EventLoop* LoopOfCpu(int cpu) const;
     ///@brief Set worker threads, each thread has a EventLoop object
     void SetNumOfWorker(size_t n);
     ///@brief Get worker threads's size
     size_t NumOfWorker() const;
+    ///@brief Set poller for all event loops, must be called before Run
+    void SetPollerType(PollerType type);
+    ///@brief Set edge triggered mode for all event loops, must be called before Run
+    void SetEdgeTriggered(bool et);
+    ///@brief Set timer mode for all event loops, must be called before Run
+    void SetTimerMode(TimerMode mode);
+    ///@brief Drive timers of all event loops by timerfd, must be called before Run
+    void SetHighResolutionTimer(bool enable);
+    ///@brief Busy poll for all event loops, must be called before Run
+    ///
+    /// See EventLoop::SetBusyPoll
+    void SetBusyPoll(std::chrono::microseconds budget, bool sockBusyPoll = false);
+    ///@brief Each worker listens with SO_REUSEPORT, must be called before Run
+    ///
+    /// Kernel distributes new connections between workers' listeners, they
+    /// are accepted in worker loops directly instead of base loop.
+    /// TCP listens before Run are deferred until workers started.
+    void SetReusePort(bool reuse);
+    ///@brief Each worker binds UDP listener with SO_REUSEPORT, must be called before Run
+    ///
+    /// Packets are received in worker loops instead of base loop, the socket
+    /// of one loop is passed to UDPCreateCallback. UDP listens before Run are
+    /// deferred until workers started.
+    /// If steering can not be attached, kernel hash is used.
+    void SetUdpReusePort(bool reuse, UdpSteering steering = UdpSteering::eUS_Kernel);
+    ///@brief Max connections accepted by one listener in one wakeup, must be called before Run
+    void SetAcceptBudget(std::size_t budget);
+    ///@brief Deferred flush for all event loops, must be called before Run
+    ///
+    /// See EventLoop::SetDeferredFlush
+    void SetDeferredFlush(bool enable);
 
 private:
     Application();  // 单例模式
 
     void _StartWorkers();
+    void _ListenReusePort(const SocketAddr& listenAddr,
+                          NewTcpConnCallback cb,
+                          BindCallback bfcb);
+    struct UdpShard;
+    void _ListenUDPReusePort(const SocketAddr& listenAddr,
+                             UDPMessageCallback mcb,
+                             UDPCreateCallback ccb,
+                             BindCallback bfcb);
+    // bind in order, socket index in group is loop index
+    static void _BindUdpShard(std::shared_ptr<UdpShard> shard, std::size_t i);
+    // close sockets of the first count loops
+    static void _CloseUdpShard(std::shared_ptr<UdpShard> shard, std::size_t count);
+    static void _AttachUdpSteering(const UdpShard& shard, int sock);
+    void _WakeupWorkers();
+    EventLoop* _LeastConn() const;
+    EventLoop* _PowerOfTwo() const;
 
     // The default loop for accept/connect, or as worker if empty worker pool
     EventLoop base_;    // application具有一个base eventloop, 主eventloop
@@ -142,7 +227,40 @@ private:
     ThreadPool pool_;   // 线程池, 分配线程
     std::vector<std::unique_ptr<EventLoop>> loops_; // 子痫程的loops
     size_t numLoop_ {0};
+    PollerType pollerType_ {PollerType::ePT_Default};
+    bool edgeTriggered_ {false};
+    TimerMode timerMode_ {TimerMode::eTM_Default};
+    bool highResTimer_ {false};
+    std::chrono::microseconds busyPollBudget_ {0};
+    bool sockBusyPoll_ {false};
+    bool deferredFlush_ {false};
+
+    // SO_REUSEPORT listeners, they wait for workers started
+    bool reusePort_ {false};
+    std::size_t acceptBudget_ {64};
+    struct PendingListen {
+        SocketAddr addr;
+        NewTcpConnCallback cb;
+        BindCallback bfcb;
+    };
+    std::vector<PendingListen> pendingListens_;
+
+    bool udpReusePort_ {false};
+    UdpSteering udpSteering_ {UdpSteering::eUS_Kernel};
+    struct PendingUDPListen {
+        SocketAddr addr;
+        UDPMessageCallback mcb;
+        UDPCreateCallback ccb;
+        BindCallback bfcb;
+    };
+    std::vector<PendingUDPListen> pendingUDPListens_;
     mutable std::atomic<size_t> currentLoop_ {0};
+    LoadBalance loadBalance_ {LoadBalance::eLB_RoundRobin};
+
+    // cpu placement, cpuLoops_ is indexed by cpu id
+    bool pinned_ {false};
+    bool matchIncomingCpu_ {false};
+    std::vector<EventLoop*> cpuLoops_;
 
     enum class State {
         eS_None,
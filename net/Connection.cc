@@ -1,10 +1,29 @@
 #include "Connection.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#if defined(__gnu_linux__)
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(__gnu_linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define ANANAS_ZEROCOPY 1
+#endif
+
+#if defined(MSG_MORE)
+static const int kMsgMore = MSG_MORE;
+#else
+static const int kMsgMore = 0;
+#endif
 
 #include "EventLoop.h"
 #include "AnanasDebug.h"
@@ -15,24 +34,88 @@ namespace ananas {
 using internal::eET_Read;   // 事件类型
 using internal::eET_Write;
 
+namespace {
+// Read readiness of SendFile's source like pipe or socket
+class FileSourceChannel : public internal::Channel {
+public:
+    FileSourceChannel(int fd, std::function<void ()> ready) :
+        fd_(fd),
+        ready_(std::move(ready)) {
+    }
+
+    int Identifier() const override {
+        return fd_;
+    }
+
+    bool HandleReadEvent() override {
+        ready_();
+        return true;
+    }
+
+    bool HandleWriteEvent() override {
+        assert (false);
+        return false;
+    }
+
+    void HandleErrorEvent() override {
+        // writer is closed, splice will see EOF or error
+        ready_();
+    }
+
+private:
+    const int fd_; // owned by FileChunk
+    std::function<void ()> ready_;
+};
+} // end namespace
+
 Connection::Connection(EventLoop* loop) :
     loop_(loop),
     localSock_(kInvalid),
-    minPacketSize_(1) {
+    minPacketSize_(1),
+    lowWater_(kDefaultLowWater),
+    highWater_(kDefaultHighWater) {
 }   // 构造函数
 
+const std::size_t Connection::kZeroCopyThreshold = 32 * 1024;
+const DurationMs Connection::kZeroCopyLingerTimeout(30 * 1000);
+const std::size_t Connection::kDefaultLowWater = 16 * 1024 * 1024;
+const std::size_t Connection::kDefaultHighWater = 64 * 1024 * 1024;
+
 Connection::~Connection() {
+    // Watcher is stopped when closed, or loop is clearing all channels now
+    fileWatcher_.reset();
+
     if (localSock_ != kInvalid) {
         Shutdown(ShutdownMode::eSM_Both); // Force send FIN
-        CloseSocket(localSock_);
+        _ReapZeroCopy();
+        if (zcPending_.empty()) {
+            CloseSocket(localSock_);
+        } else {
+            // Kernel may still be sending from the memory, it can't go back
+            // to pool until completions arrive on the socket's error queue.
+            auto linger = std::make_shared<ZeroCopyLinger>();
+            linger->sock = localSock_;
+            linger->pending = std::move(zcPending_);
+            linger->deadline = std::chrono::steady_clock::now() + kZeroCopyLingerTimeout;
+            localSock_ = kInvalid;
+
+            EventLoop* loop = loop_;
+            loop->Schedule([loop, linger]() {
+                _LingerZeroCopy(loop, linger, DurationMs(1));
+            });
+        }
     }
+
+    _ClearPending();
+
+    while (OutboundNode* node = outbound_.Pop())
+        delete node;
 }
 
 bool Connection::Init(int fd, const SocketAddr& peer) {
     if (fd == kInvalid)
         return false;
-    localSock_ = fd;    // Connection维护的fd
-    SetNonBlock(localSock_);    // 非阻塞fd
+    localSock_ = fd;    // Connection维护的fd, 必须已经是非阻塞的
     peer_ = peer;   // 对方SocketAddr
     assert(state_ == State::eS_None);   // release式一般没有assert
     state_ = State::eS_Connected;   // 连接状态
@@ -42,7 +125,10 @@ bool Connection::Init(int fd, const SocketAddr& peer) {
 void Connection::ActiveClose() {
     if (localSock_ == kInvalid)
         return;
-    if (sendBuf_.Empty()) { // 发送缓冲为空
+
+    // response batched in this iteration must be sent before close
+    _MoveBatchToPending();
+    if (!_HasPendingSend()) { // 发送缓冲为空
         Shutdown(ShutdownMode::eSM_Both);   // shutdown
         state_ = State::eS_ActiveClose;
     }else {
@@ -54,24 +140,31 @@ void Connection::ActiveClose() {
 }
 
 void Connection::Shutdown(ShutdownMode mode) {
+    if (mode != ShutdownMode::eSM_Read && localSock_ != kInvalid) {
+        // send what we can before FIN, batched data included
+        _MoveBatchToPending();
+        if (_HasPendingSend())
+            _SendPending();
+    }
+
     switch (mode) {
     case ShutdownMode::eSM_Read:
         ::shutdown(localSock_, SHUT_RD);    // 关闭
         break;
 
     case ShutdownMode::eSM_Write:
-        if (!sendBuf_.Empty()) {
+        if (_HasPendingSend()) {
             ANANAS_WRN << localSock_ << " shutdown write, but still has data to send";
-            sendBuf_.Clear();   // 直接抛弃剩下要发送的数据
+            _ClearPending();   // 直接抛弃剩下要发送的数据
         }
 
         ::shutdown(localSock_, SHUT_WR);
         break;
 
     case ShutdownMode::eSM_Both:
-        if (!sendBuf_.Empty()) {
+        if (_HasPendingSend()) {
             ANANAS_WRN << localSock_ << " shutdown both, but still has data to send";
-            sendBuf_.Clear();
+            _ClearPending();
         }
 
         ::shutdown(localSock_, SHUT_RDWR);
@@ -94,20 +187,48 @@ bool Connection::HandleReadEvent() {
         return false;
     }
 
+    // ET mode may still report readable
+    if (readPaused_)
+        return true;
+
     processingRead_ = true;
     ANANAS_DEFER {
         processingRead_ = false;
-        if (!batchSendBuf_.IsEmpty()) {
-            SendPacket(batchSendBuf_);
-            batchSendBuf_.Clear();
+        if (!dirty_)
+            _FlushBatch(); // else loop will flush it
+    };
+
+    // Idle connection holds no receive buffer, data is read into
+    // loop's scratch, only the part not consumed is saved in recvBuf_.
+    ANANAS_DEFER {
+        if (recvBuf_.IsEmpty()) {
+            if (recvBuf_.Capacity() > 0) {
+                Buffer empty;
+                recvBuf_.Swap(empty);
+            }
+        } else {
+            recvBuf_.Shrink();
         }
     };
 
-    bool busy = false;
-    while (true) {
-        // 首先读取fd的信息到缓冲区recvBuf_
-        recvBuf_.AssureSpace(8 * 1024);
-        int bytes = ::recv(localSock_, recvBuf_.WriteAddr(), recvBuf_.WritableSize(), 0);
+    char* const scratch = loop_->ScratchBuffer();
+    while (!readPaused_) {
+        // 首先读取fd的信息: 先填满recvBuf_已有的空间, 剩下的到scratch
+        const bool pending = !recvBuf_.IsEmpty();
+        const std::size_t space = pending ? recvBuf_.WritableSize() : 0;
+
+        iovec iov[2];
+        int iovcnt = 0;
+        if (space > 0) {
+            iov[iovcnt].iov_base = recvBuf_.WriteAddr();
+            iov[iovcnt].iov_len = space;
+            ++ iovcnt;
+        }
+        iov[iovcnt].iov_base = scratch;
+        iov[iovcnt].iov_len = EventLoop::kScratchSize;
+        ++ iovcnt;
+
+        int bytes = static_cast<int>(::readv(localSock_, iov, iovcnt));
         if (bytes == kError) {
             if (EAGAIN == errno || EWOULDBLOCK == errno)
                 return true;
@@ -123,7 +244,7 @@ bool Connection::HandleReadEvent() {
 
         if (bytes == 0) {
             ANANAS_WRN << localSock_ << " HandleReadEvent EOF ";
-            if (sendBuf_.Empty()) {
+            if (!_HasPendingSend()) {
                 Shutdown(ShutdownMode::eSM_Both);
                 state_ = State::eS_PassiveClose;
             } else {
@@ -135,38 +256,48 @@ bool Connection::HandleReadEvent() {
             return false;
         }
 
-        // 然后调用Produce设置writepos更新可写位置
-        recvBuf_.Produce(static_cast<size_t>(bytes));
-        while (recvBuf_.ReadableSize() >= minPacketSize_) {
-            size_t bytes = 0;
-            
-            // 3. 调用onMessage_信息回调函数执行处理函数, 该函数是用户自定义的逻辑。onMessage已经包含了send data
-            if (onMessage_) {
-                bytes = onMessage_(this,
-                                   recvBuf_.ReadAddr(),
-                                   recvBuf_.ReadableSize());
-            } else {
-                // default: just echo
-                bytes = recvBuf_.ReadableSize();
-                SendPacket(recvBuf_);
-            }
-
-            if (bytes == 0) {
-                break;
-            } else {
-                // 4. send data之后调用 Consume更新readpos位置
-                recvBuf_.Consume(bytes);
-                busy = true;
-            }
+        if (!pending) {
+            // fast path: process in scratch, no copy
+            const std::size_t consumed = _OnMessage(scratch, static_cast<size_t>(bytes));
+            recvBuf_.PushData(scratch + consumed, static_cast<size_t>(bytes) - consumed);
+            continue;
         }
-    }
 
-    if (busy)
-        recvBuf_.Shrink();
+        // 然后调用Produce设置writepos更新可写位置, 溢出到scratch的部分追加到recvBuf_
+        const std::size_t inBuf = std::min(space, static_cast<size_t>(bytes));
+        recvBuf_.Produce(inBuf);
+        recvBuf_.PushData(scratch, static_cast<size_t>(bytes) - inBuf);
+
+        // 4. 处理之后调用 Consume更新readpos位置
+        recvBuf_.Consume(_OnMessage(recvBuf_.ReadAddr(), recvBuf_.ReadableSize()));
+    }
 
     return true;
 }
 
+std::size_t Connection::_OnMessage(const char* data, std::size_t len) {
+    std::size_t consumed = 0;
+    while (len - consumed >= minPacketSize_) {
+        size_t bytes = 0;
+
+        // 3. 调用onMessage_信息回调函数执行处理函数, 该函数是用户自定义的逻辑。onMessage已经包含了send data
+        if (onMessage_) {
+            bytes = onMessage_(this, data + consumed, len - consumed);
+        } else {
+            // default: just echo
+            bytes = len - consumed;
+            SendPacket(data + consumed, bytes);
+        }
+
+        if (bytes == 0)
+            break;
+
+        consumed += bytes;
+    }
+
+    return consumed;
+}
+
 
 int Connection::_Send(const void* data, size_t len) {   // 发送数据
     if (len == 0)
@@ -190,8 +321,8 @@ int Connection::_Send(const void* data, size_t len) {   // 发送数据
 
 namespace {
 int WriteV(int , const std::vector<iovec>& );
-void ConsumeBufferVectors(BufferVector& , size_t );
-void CollectBuffer(const std::vector<iovec>& , size_t , BufferVector& );
+ssize_t WriteIOBuf(int , IOBuf& , int flags = 0);
+void CollectBuffer(const std::vector<iovec>& , size_t , IOBuf& );
 }
 
 bool Connection::HandleWriteEvent() {   // Connection可写回调, 水平触发条件下fd缓冲有空间时会自动触发可写事件
@@ -204,34 +335,17 @@ bool Connection::HandleWriteEvent() {   // Connection可写回调, 水平触发
 
     // it's connected or half-close, whatever, we can send.
 
-    size_t expectSend = 0;
-    std::vector<iovec> iovecs;
-    for (auto& e : sendBuf_) {  // 将sendBuf_的数据包装成块数据发送
-        assert (!e.IsEmpty());
-
-        iovec ivc;
-        ivc.iov_base = (void*)(e.ReadAddr());
-        ivc.iov_len = e.ReadableSize();
-
-        iovecs.push_back(ivc);
-        expectSend += e.ReadableSize();
-    }
-
-    int ret = WriteV(localSock_, iovecs);   // iovecs块数据发送到Connection fd中
-    if (ret == kError) {
+    if (_SendPending() == kError) {
         ANANAS_ERR << localSock_ << " HandleWriteEvent ERROR ";
         Shutdown(ShutdownMode::eSM_Both);
         state_ = State::eS_Error;
         return false;
     }
 
-    assert (ret >= 0);
-
-    size_t alreadySent = static_cast<size_t>(ret);
-    ConsumeBufferVectors(sendBuf_, alreadySent);
+    _CheckLowWater();
 
-    if (alreadySent == expectSend) {
-        loop_->Modify(eET_Read, shared_from_this());
+    if (!_HasPendingSend()) {
+        loop_->Modify(_Interest(), shared_from_this());
 
         if (onWriteComplete_)
             onWriteComplete_(this);
@@ -240,12 +354,28 @@ bool Connection::HandleWriteEvent() {   // Connection可写回调, 水平触发
             state_ = State::eS_PassiveClose;
             return false;
         }
+    } else if (waitFileSource_) {
+        // Don't spin on writable event, watcher will resume sending
+        loop_->Modify(_Interest(), shared_from_this());
     }
 
     return true;
 }
 
 void  Connection::HandleErrorEvent() {  // 错误事件回调函数
+    // EPOLLERR is also reported for zero copy completions
+    if ((state_ == State::eS_Connected || state_ == State::eS_CloseWaitWrite) &&
+        _ReapZeroCopy()) {
+        // A real error may come in same wakeup, ET mode won't report it again
+        int error = 0;
+        socklen_t len = sizeof error;
+        if (::getsockopt(localSock_, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+            return;
+
+        ANANAS_ERR << localSock_ << " socket error " << error;
+        state_ = State::eS_Error;
+    }
+
     ANANAS_ERR << localSock_ << " HandleErrorEvent " << state_;
 
     switch (state_) {
@@ -267,6 +397,7 @@ void  Connection::HandleErrorEvent() {  // 错误事件回调函数
     if (onDisconnect_)
         onDisconnect_(this);
 
+    _StopWaitFileSource();
     loop_->Unregister(eET_Read | eET_Write, shared_from_this());
 }
 
@@ -274,20 +405,59 @@ bool Connection::SafeSend(const void* data, std::size_t size) { // 安全的发
     if (loop_->InThisLoop())
         return this->SendPacket(data, size);
     else
-        return SafeSend(std::string((const char*)data, size));
+        return SafeSend(IOBuf(data, size));
 }
 
 bool Connection::SafeSend(const std::string& data) {
+    return SafeSend(data.data(), data.size());
+}
+
+bool Connection::SafeSend(Buffer&& data) {
     if (loop_->InThisLoop())
-        return this->SendPacket(data);
+        return this->SendPacket(std::move(data));
     else
-        loop_->Execute([this, data]() {
-                          this->SendPacket(data);
-                       });
+        return SafeSend(IOBuf(std::move(data)));
+}
+
+bool Connection::SafeSend(IOBuf&& data) {
+    if (loop_->InThisLoop())
+        return this->SendPacket(data);
+
+    if (data.Empty())
+        return true;
+
+    OutboundNode* node = new OutboundNode;
+    node->data = std::move(data);
+    outbound_.Push(node);
+
+    // Must after Push, see EventLoop::_PostTask
+    if (!outboundPending_.exchange(true, std::memory_order_acq_rel)) {
+        std::weak_ptr<Connection> wc(std::static_pointer_cast<Connection>(shared_from_this()));
+        loop_->Schedule([wc]() {
+            if (auto conn = wc.lock())
+                conn->_FlushOutbound();
+        });
+    }
 
     return true;
 }
 
+void Connection::_FlushOutbound() {
+    assert (loop_->InThisLoop());
+
+    // Must before Pop
+    outboundPending_.exchange(false, std::memory_order_acq_rel);
+
+    IOBuf out;
+    while (OutboundNode* node = outbound_.Pop()) {
+        std::unique_ptr<OutboundNode> guard(node);
+        out.Append(std::move(node->data));
+    }
+
+    if (!out.Empty())
+        SendPacket(out);
+}
+
 bool Connection::SendPacket(const void* data, std::size_t size) {
     assert (loop_->InThisLoop());
 
@@ -298,13 +468,15 @@ bool Connection::SendPacket(const void* data, std::size_t size) {
         state_ != State::eS_CloseWaitWrite)
         return false;
 
-    if (!sendBuf_.Empty()) {
-        sendBuf_.Push(data, size);
+    if (_HasPendingSend()) {
+        _SendTail().Append(data, size);
+        _CheckHighWater();
         return true;
     }
 
-    if (processingRead_ && batchSend_) {
-        batchSendBuf_.PushData(data, size);
+    if (_ShouldBatch()) {
+        batchSendBuf_.Append(data, size);
+        _MarkDirty();
         return true;
     }
 
@@ -322,8 +494,9 @@ bool Connection::SendPacket(const void* data, std::size_t size) {
                    << size
                    << " bytes, but only send "
                    << bytes;
-        sendBuf_.Push((char*)data + bytes, size - static_cast<std::size_t>(bytes));
-        loop_->Modify(eET_Read | eET_Write, shared_from_this());
+        sendBuf_.Append((char*)data + bytes, size - static_cast<std::size_t>(bytes));
+        loop_->Modify(_Interest(), shared_from_this());
+        _CheckHighWater();
     } else {
         if (onWriteComplete_)
             onWriteComplete_(this);
@@ -340,6 +513,52 @@ bool Connection::SendPacket(const Buffer& data) {
     return SendPacket(const_cast<Buffer&>(data).ReadAddr(), data.ReadableSize());
 }
 
+bool Connection::SendPacket(Buffer&& data) {
+    return SendPacket(IOBuf(std::move(data)));
+}
+
+bool Connection::SendPacket(const IOBuf& data) {
+    assert (loop_->InThisLoop());
+
+    if (data.Empty())
+        return true;
+
+    if (state_ != State::eS_Connected &&
+        state_ != State::eS_CloseWaitWrite)
+        return false;
+
+    if (_HasPendingSend()) {
+        _SendTail().Append(data);
+        _CheckHighWater();
+        return true;
+    }
+
+    if (_ShouldBatch()) {
+        batchSendBuf_.Append(data);
+        _MarkDirty();
+        return true;
+    }
+
+    IOBuf left(data);
+    if (WriteIOBuf(localSock_, left) == kError) {
+        Shutdown(ShutdownMode::eSM_Both);
+        state_ = State::eS_Error;
+        loop_->Modify(eET_Write, shared_from_this());
+        return false;
+    }
+
+    if (!left.Empty()) {
+        sendBuf_ = std::move(left);
+        loop_->Modify(_Interest(), shared_from_this());
+        _CheckHighWater();
+    } else {
+        if (onWriteComplete_)
+            onWriteComplete_(this);
+    }
+
+    return true;
+}
+
 // iovec for writev
 namespace {
 
@@ -383,34 +602,58 @@ int WriteV(int sock, const std::vector<iovec>& buffers) {
     return sentBytes;
 }
 
-void ConsumeBufferVectors(BufferVector& buffers, size_t toSkippedBytes) {   // 消费Buffer
-    size_t skippedVecs = 0;
-    for (auto& e : buffers) {
-        assert (e.ReadableSize() > 0);
+// flags is for sendmsg, eg. MSG_MORE
+ssize_t WriteIOBuf(int sock, IOBuf& buf, int flags) {
+    const int kIOVecCount = 64; // be care of IOV_MAX
+
+    size_t sentBytes = 0;
+    iovec iov[kIOVecCount];
+    while (!buf.Empty()) {
+        const int vc = static_cast<int>(buf.ToIovec(iov, kIOVecCount));
+
+        size_t expectBytes = 0;
+        for (int i = 0; i < vc; ++ i)
+            expectBytes += iov[i].iov_len;
 
-        if (toSkippedBytes >= e.ReadableSize()) {
-            toSkippedBytes -= e.ReadableSize();
-            ++ skippedVecs;
+        ssize_t bytes = kError;
+        if (flags == 0) {
+            bytes = ::writev(sock, iov, vc);
         } else {
-            if (toSkippedBytes > 0) {
-                e.Consume(toSkippedBytes);
-                buffers.totalBytes -= toSkippedBytes;
-            }
+            msghdr msg;
+            ::memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = vc;
+            bytes = ::sendmsg(sock, &msg, flags);
+        }
 
-            break;
+        if (kError == bytes) {
+            assert (errno != EINVAL);
+
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+
+            if (EINTR == errno)
+                continue; // retry
+
+            return kError;  // can not send any more
         }
+
+        assert (bytes > 0);
+        buf.TrimStart(static_cast<size_t>(bytes));
+        sentBytes += static_cast<size_t>(bytes);
+        if (static_cast<size_t>(bytes) != expectBytes)
+            break;
     }
 
-    while (skippedVecs-- > 0)
-        buffers.Pop();
+    return static_cast<ssize_t>(sentBytes);
 }
 
-void CollectBuffer(const std::vector<iovec>& buffers, size_t skipped, BufferVector& dst) {
+void CollectBuffer(const std::vector<iovec>& buffers, size_t skipped, IOBuf& dst) {
     for (auto e : buffers) {
         if (skipped >= e.iov_len) {
             skipped -= e.iov_len;
         } else {
-            dst.Push((char*)e.iov_base + skipped, e.iov_len - skipped);
+            dst.Append((char*)e.iov_base + skipped, e.iov_len - skipped);
 
             if (skipped != 0)
                 skipped = 0;
@@ -437,19 +680,22 @@ bool Connection::SendPacket(const SliceVector& slices) {
     if (slices.Empty())
         return true;
 
-    if (!sendBuf_.Empty()) {
+    if (_HasPendingSend()) {
+        auto& tail = _SendTail();
         for (const auto& e : slices) {
-            sendBuf_.Push(e.data, e.len);
+            tail.Append(e.data, e.len);
         }
 
+        _CheckHighWater();
         return true;
     }
 
-    if (processingRead_ && batchSend_) {
+    if (_ShouldBatch()) {
         for (const auto& e : slices) {
-            batchSendBuf_.PushData(e.data, e.len);
+            batchSendBuf_.Append(e.data, e.len);
         }
 
+        _MarkDirty();
         return true;
     }
 
@@ -480,7 +726,8 @@ bool Connection::SendPacket(const SliceVector& slices) {
     size_t alreadySent = static_cast<size_t>(ret);
     if (alreadySent < expectSend) {
         CollectBuffer(iovecs, alreadySent, sendBuf_);
-        loop_->Modify(eET_Read | eET_Write, shared_from_this());
+        loop_->Modify(_Interest(), shared_from_this());
+        _CheckHighWater();
     } else {
         if (onWriteComplete_)
             onWriteComplete_(this);
@@ -489,6 +736,587 @@ bool Connection::SendPacket(const SliceVector& slices) {
     return true;
 }
 
+bool Connection::SendPacketZeroCopy(Buffer&& data) {
+    return SendPacketZeroCopy(IOBuf(std::move(data)));
+}
+
+bool Connection::SendPacketZeroCopy(const IOBuf& data) {
+    assert (loop_->InThisLoop());
+
+    if (data.Size() < kZeroCopyThreshold || !_EnableZeroCopy())
+        return SendPacket(data);
+
+    if (state_ != State::eS_Connected &&
+        state_ != State::eS_CloseWaitWrite)
+        return false;
+
+    if (_HasPendingSend()) {
+        _SendTail().Append(data); // HandleWriteEvent will send it with zero copy
+        _CheckHighWater();
+        return true;
+    }
+
+    // batched data goes first
+    IOBuf left(std::move(batchSendBuf_));
+    left.Append(data);
+
+    if (_SendZeroCopy(left) == kError) {
+        Shutdown(ShutdownMode::eSM_Both);
+        state_ = State::eS_Error;
+        loop_->Modify(eET_Write, shared_from_this());
+        return false;
+    }
+
+    if (!left.Empty()) {
+        sendBuf_ = std::move(left);
+        loop_->Modify(_Interest(), shared_from_this());
+        _CheckHighWater();
+    } else {
+        if (onWriteComplete_)
+            onWriteComplete_(this);
+    }
+
+    return true;
+}
+
+bool Connection::_EnableZeroCopy() {
+    if (!zcTried_) {
+        zcTried_ = true;
+        zeroCopy_ = SetZeroCopy(localSock_);
+    }
+
+    return zeroCopy_;
+}
+
+ssize_t Connection::_SendZeroCopy(IOBuf& buf) {
+#if defined(ANANAS_ZEROCOPY)
+    const int kIOVecCount = 64; // be care of IOV_MAX
+
+    size_t sentBytes = 0;
+    iovec iov[kIOVecCount];
+    while (!buf.Empty()) {
+        msghdr msg;
+        ::memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = buf.ToIovec(iov, kIOVecCount);
+
+        size_t expectBytes = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; ++ i)
+            expectBytes += iov[i].iov_len;
+
+        bool pinned = true;
+        ssize_t bytes = ::sendmsg(localSock_, &msg, MSG_ZEROCOPY);
+        if (kError == bytes && ENOBUFS == errno) {
+            // too much memory pinned(optmem_max), copy this time
+            pinned = false;
+            bytes = ::writev(localSock_, iov, static_cast<int>(msg.msg_iovlen));
+        }
+
+        if (kError == bytes) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+
+            if (EINTR == errno)
+                continue; // retry
+
+            return kError;
+        }
+
+        assert (bytes > 0);
+        if (pinned)
+            zcPending_.push_back({zcNextId_++, buf.Slice(0, static_cast<size_t>(bytes))});
+
+        buf.TrimStart(static_cast<size_t>(bytes));
+        sentBytes += static_cast<size_t>(bytes);
+        if (static_cast<size_t>(bytes) != expectBytes)
+            break;
+    }
+
+    return static_cast<ssize_t>(sentBytes);
+#else
+    return WriteIOBuf(localSock_, buf);
+#endif
+}
+
+bool Connection::_ReapZeroCopy() {
+    bool copied = false;
+    const bool reaped = _ReapZeroCopy(localSock_, zcPending_, copied);
+    if (copied)
+        zeroCopy_ = false;
+
+    return reaped;
+}
+
+void Connection::_LingerZeroCopy(EventLoop* loop,
+                                 std::shared_ptr<ZeroCopyLinger> linger,
+                                 DurationMs delay) {
+    bool copied = false;
+    _ReapZeroCopy(linger->sock, linger->pending, copied);
+    if (linger->pending.empty()) {
+        CloseSocket(linger->sock);
+        linger->sock = kInvalid;
+        return;
+    }
+
+    if (std::chrono::steady_clock::now() >= linger->deadline) {
+        // peer doesn't ack for too long, give up; socket is closed by ~ZeroCopyLinger
+        ANANAS_WRN << "Close socket " << linger->sock
+                   << " with zero copy pending: " << linger->pending.size();
+        return;
+    }
+
+    // completions come after peer acks, check less often as time goes
+    const DurationMs next = std::min(delay * 2, DurationMs(100));
+    loop->ScheduleAfter(delay, [loop, linger, next]() {
+        _LingerZeroCopy(loop, linger, next);
+    });
+}
+
+Connection::ZeroCopyLinger::~ZeroCopyLinger() {
+    // timeout, or loop is destroyed with the linger task
+    if (sock != kInvalid)
+        CloseSocket(sock);
+}
+
+bool Connection::_ReapZeroCopy(int sock, std::deque<ZeroCopyChunk>& pending, bool& copied) {
+#if defined(ANANAS_ZEROCOPY)
+    bool reaped = false;
+    while (!pending.empty()) {
+        char control[128];
+        msghdr msg;
+        ::memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        if (::recvmsg(sock, &msg, MSG_ERRQUEUE) == kError)
+            break; // EAGAIN, no more completion
+
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            const bool ipErr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                               (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!ipErr)
+                continue;
+
+            const auto serr = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // Kernel copied the data, eg. loopback or no sg support,
+            // zero copy is only overhead then.
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied = true;
+
+            // completions of [ee_info, ee_data], they are in order for TCP
+            const uint32_t last = serr->ee_data;
+            while (!pending.empty() &&
+                   static_cast<int32_t>(pending.front().id - last) <= 0)
+                pending.pop_front();
+
+            reaped = true;
+        }
+    }
+
+    return reaped;
+#else
+    (void)sock;
+    (void)pending;
+    (void)copied;
+    return false;
+#endif
+}
+
+bool Connection::SendFile(int fd, off_t offset, std::size_t len) {
+    assert (loop_->InThisLoop());
+
+    if (len == 0)
+        return true;
+
+    if (state_ != State::eS_Connected &&
+        state_ != State::eS_CloseWaitWrite)
+        return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ANANAS_ERR << localSock_ << " SendFile fstat failed " << errno;
+        return false;
+    }
+
+#if defined(__gnu_linux__)
+    FileChunk file;
+    file.fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (file.fd == kInvalid) {
+        ANANAS_ERR << localSock_ << " SendFile dup failed " << errno;
+        return false;
+    }
+
+    file.offset = offset;
+    file.len = len;
+    file.regular = S_ISREG(st.st_mode);
+    file.pipe[0] = file.pipe[1] = kInvalid;
+    file.inPipe = 0;
+
+    const bool idle = !_HasPendingSend();
+
+    // batched data was sent before the file
+    _MoveBatchToPending();
+
+    sendFiles_.push_back(std::move(file));
+    if (!idle) {
+        _CheckHighWater();
+        return true; // HandleWriteEvent will send it
+    }
+
+    if (_SendPending() == kError) {
+        Shutdown(ShutdownMode::eSM_Both);
+        state_ = State::eS_Error;
+        loop_->Modify(eET_Write, shared_from_this());
+        return false;
+    }
+
+    if (_HasPendingSend()) {
+        loop_->Modify(_Interest(), shared_from_this());
+        _CheckHighWater();
+    } else {
+        if (onWriteComplete_)
+            onWriteComplete_(this);
+    }
+
+    return true;
+#else
+    // no linux sendfile, read it to memory
+    if (!S_ISREG(st.st_mode)) {
+        ANANAS_ERR << localSock_ << " SendFile only support regular file";
+        return false;
+    }
+
+    IOBuf data;
+    while (len > 0) {
+        std::size_t want = std::min(len, IOBuf::kBlockSize);
+        char* space = data.AppendSpace(want);
+        auto n = ::pread(fd, space, want, offset);
+        if (n <= 0)
+            break;
+
+        data.Produce(static_cast<std::size_t>(n));
+        offset += n;
+        len -= static_cast<std::size_t>(n);
+    }
+
+    return SendPacket(data);
+#endif
+}
+
+ssize_t Connection::_SendPending() {
+    ssize_t sentBytes = 0;
+    while (true) {
+        if (!sendBuf_.Empty()) {
+            // writev straight from the chain, sent bytes are trimmed.
+            // If a file follows, eg. http header, let it share packets with file
+            ssize_t ret = (zeroCopy_ && sendBuf_.Size() >= kZeroCopyThreshold) ?
+                      _SendZeroCopy(sendBuf_) :
+                      WriteIOBuf(localSock_, sendBuf_, sendFiles_.empty() ? 0 : kMsgMore);
+            if (ret == kError)
+                return kError;
+
+            sentBytes += ret;
+            if (!sendBuf_.Empty())
+                break;
+        }
+
+        if (sendFiles_.empty())
+            break;
+
+        auto& file = sendFiles_.front();
+        ssize_t ret = _SendFileChunk(file);
+        if (ret == kError)
+            return kError;
+
+        sentBytes += ret;
+        if (file.len > 0 || file.inPipe > 0)
+            break;
+
+        // file done, data after it is the next
+        sendBuf_ = std::move(file.trailer);
+        _CloseFileChunk(file);
+        sendFiles_.pop_front();
+    }
+
+    return sentBytes;
+}
+
+ssize_t Connection::_SendFileChunk(FileChunk& file) {
+#if defined(__gnu_linux__)
+    ssize_t sentBytes = 0;
+    if (file.regular) {
+        while (file.len > 0) {
+            auto n = ::sendfile(localSock_, file.fd, &file.offset, file.len);
+            if (n < 0) {
+                if (EAGAIN == errno || EWOULDBLOCK == errno)
+                    break;
+
+                if (EINTR == errno)
+                    continue;
+
+                ANANAS_ERR << localSock_ << " sendfile error " << errno;
+                return kError;
+            }
+
+            if (n == 0) {
+                // file is truncated
+                ANANAS_WRN << localSock_ << " sendfile EOF, left " << file.len;
+                file.len = 0;
+                break;
+            }
+
+            file.len -= static_cast<std::size_t>(n);
+            sentBytes += n;
+        }
+
+        return sentBytes;
+    }
+
+    if (file.pipe[0] == kInvalid && ::pipe2(file.pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        ANANAS_ERR << localSock_ << " pipe2 error " << errno;
+        return kError;
+    }
+
+    const unsigned int kFlags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    while (file.len > 0 || file.inPipe > 0) {
+        if (file.inPipe == 0) {
+            auto n = ::splice(file.fd, nullptr, file.pipe[1], nullptr, file.len, kFlags);
+            if (n < 0) {
+                if (EINTR == errno)
+                    continue;
+
+                if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                    // source is not ready
+                    if (!_WaitFileSource(file.fd))
+                        return kError;
+
+                    break;
+                }
+
+                ANANAS_ERR << localSock_ << " splice from " << file.fd << " error " << errno;
+                return kError;
+            }
+
+            if (n == 0) {
+                ANANAS_WRN << localSock_ << " splice EOF, left " << file.len;
+                file.len = 0;
+                break;
+            }
+
+            file.len -= static_cast<std::size_t>(n);
+            file.inPipe += static_cast<std::size_t>(n);
+        }
+
+        auto n = ::splice(file.pipe[0], nullptr, localSock_, nullptr, file.inPipe, kFlags);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+
+            ANANAS_ERR << localSock_ << " splice to socket error " << errno;
+            return kError;
+        }
+
+        file.inPipe -= static_cast<std::size_t>(n);
+        sentBytes += n;
+    }
+
+    return sentBytes;
+#else
+    (void)file;
+    return kError;
+#endif
+}
+
+bool Connection::_WaitFileSource(int fd) {
+    waitFileSource_ = true;
+    if (fileWatcher_)
+        return true;
+
+    std::weak_ptr<Connection> wc(std::static_pointer_cast<Connection>(shared_from_this()));
+    auto watcher = std::make_shared<FileSourceChannel>(fd, [wc]() {
+        if (auto conn = wc.lock())
+            conn->_OnFileSourceReady();
+    });
+
+    // fd is dup-ed by SendFile, it's not registered by others
+    if (!loop_->Register(eET_Read, watcher)) {
+        ANANAS_ERR << localSock_ << " can not poll file source " << fd;
+        waitFileSource_ = false;
+        return false;
+    }
+
+    fileWatcher_ = std::move(watcher);
+    return true;
+}
+
+void Connection::_StopWaitFileSource() {
+    waitFileSource_ = false;
+    if (fileWatcher_) {
+        loop_->Unregister(eET_Read, fileWatcher_);
+        fileWatcher_.reset();
+    }
+}
+
+void Connection::_OnFileSourceReady() {
+    if (!waitFileSource_)
+        return;
+
+    _StopWaitFileSource();
+    if (!HandleWriteEvent()) {
+        HandleErrorEvent();
+        return;
+    }
+
+    if (_HasPendingSend() && !waitFileSource_)
+        loop_->Modify(_Interest(), shared_from_this());
+}
+
+void Connection::_CloseFileChunk(FileChunk& file) {
+    if (file.fd != kInvalid) {
+        ::close(file.fd);
+        file.fd = kInvalid;
+    }
+
+    for (int& p : file.pipe) {
+        if (p != kInvalid) {
+            ::close(p);
+            p = kInvalid;
+        }
+    }
+}
+
+void Connection::_ClearPending() {
+    sendBuf_.Clear();
+    _StopWaitFileSource();
+    for (auto& file : sendFiles_)
+        _CloseFileChunk(file);
+
+    sendFiles_.clear();
+}
+
+std::size_t Connection::PendingSendBytes() const {
+    std::size_t bytes = sendBuf_.Size();
+    for (const auto& file : sendFiles_)
+        bytes += file.len + file.inPipe + file.trailer.Size();
+
+    return bytes;
+}
+
+int Connection::_Interest() const {
+    int events = readPaused_ ? 0 : eET_Read;
+    if (_HasPendingSend() && !waitFileSource_)
+        events |= eET_Write;
+
+    return events;
+}
+
+void Connection::_CheckHighWater() {
+    if (overHighWater_)
+        return;
+
+    const std::size_t pending = PendingSendBytes();
+    if (pending < highWater_)
+        return;
+
+    ANANAS_WRN << localSock_ << " over high water mark, pending " << pending;
+    overHighWater_ = true;
+
+    if (pauseReadOnHighWater_ && !readPaused_) {
+        readPaused_ = true;
+        loop_->Modify(_Interest(), shared_from_this());
+    }
+
+    if (onHighWater_)
+        onHighWater_(this, pending);
+}
+
+void Connection::_CheckLowWater() {
+    if (!overHighWater_ || PendingSendBytes() > lowWater_)
+        return;
+
+    overHighWater_ = false;
+    if (readPaused_)
+        _ResumeRead();
+
+    if (onLowWater_)
+        onLowWater_(this);
+}
+
+void Connection::_ResumeRead() {
+    readPaused_ = false;
+    if (state_ != State::eS_Connected)
+        return; // read side is closed
+
+    loop_->Modify(_Interest(), shared_from_this());
+
+    // In ET mode, data arrived when paused will not fire again
+    std::weak_ptr<Connection> wc(std::static_pointer_cast<Connection>(shared_from_this()));
+    loop_->ScheduleAfter(std::chrono::milliseconds(0), [wc]() {
+        auto conn = wc.lock();
+        if (!conn || conn->readPaused_ || conn->state_ != State::eS_Connected)
+            return;
+
+        if (!conn->HandleReadEvent())
+            conn->HandleErrorEvent();
+    });
+}
+
+void Connection::SetWaterMark(std::size_t low, std::size_t high) {
+    assert (low <= high);
+    lowWater_ = low;
+    highWater_ = high;
+}
+
+void Connection::SetOnHighWater(TcpHighWaterCallback cb) {
+    onHighWater_ = std::move(cb);
+}
+
+void Connection::SetOnLowWater(TcpLowWaterCallback cb) {
+    onLowWater_ = std::move(cb);
+}
+
+void Connection::SetPauseReadOnHighWater(bool pause) {
+    pauseReadOnHighWater_ = pause;
+    if (!pause && readPaused_)
+        _ResumeRead();
+}
+
+bool Connection::_ShouldBatch() const {
+    if (!batchSend_)
+        return false;
+
+    return processingRead_ ||
+           (loop_->DeferredFlush() && !loop_->FlushingDirty());
+}
+
+void Connection::_MarkDirty() {
+    if (dirty_ || !loop_->DeferredFlush())
+        return; // read event will flush it
+
+    dirty_ = true;
+    loop_->AddDirty(std::static_pointer_cast<Connection>(shared_from_this()));
+}
+
+void Connection::_FlushBatch() {
+    dirty_ = false;
+    if (batchSendBuf_.Empty())
+        return;
+
+    IOBuf batch(std::move(batchSendBuf_));
+    SendPacket(batch);
+}
+
+void Connection::_MoveBatchToPending() {
+    if (!batchSendBuf_.Empty())
+        _SendTail().Append(std::move(batchSendBuf_));
+}
+
 void Connection::SetBatchSend(bool batch) {
     batchSend_ = batch;
 }
@@ -2,12 +2,17 @@
 #define BERT_CONNECTION_H
 
 #include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <string>
 
 #include "Socket.h"
 #include "Poller.h"
 #include "Typedefs.h"
 #include "ananas/util/Buffer.h"
+#include "ananas/util/IOBuf.h"
+#include "ananas/util/MpscQueue.h"
 
 namespace ananas {
 
@@ -51,13 +56,48 @@ class Connection : public internal::Channel { // 连接对象, 继承自Channel
     bool SendPacket(const void* data, std::size_t len); // 发送数据, 可以是void*, string对象, Buffer对象
     bool SendPacket(const std::string& data);
     bool SendPacket(const Buffer& buf);
+    ///@brief Take over buf, no copy
+    bool SendPacket(Buffer&& buf);
+    ///@brief Share blocks of buf, no copy
+    bool SendPacket(const IOBuf& buf);
 
     bool SendPacket(const BufferVector& datum);
     bool SendPacket(const SliceVector& slice);
 
+    ///@brief Send big payload with MSG_ZEROCOPY, linux only
+    ///
+    /// Kernel reads the memory directly, buf's blocks are pinned until
+    /// the completion arrives on socket error queue.
+    /// If buf is smaller than kZeroCopyThreshold or zero copy is not
+    /// supported, it's same as SendPacket.
+    /// Once used, queued data over the threshold is also sent with zero copy.
+    bool SendPacketZeroCopy(const IOBuf& buf);
+    bool SendPacketZeroCopy(Buffer&& buf);
+    ///@brief Count of zero copy sends waiting for completion
+    std::size_t ZeroCopyPending() const {
+        return zcPending_.size();
+    }
+
+    static const std::size_t kZeroCopyThreshold;
+
+    ///@brief Send len bytes of fd from offset, without copy to user space
+    ///
+    /// Regular file is sent by sendfile, others like pipe are spliced
+    /// through a pipe, offset is ignored for them.
+    /// fd is dup-ed, caller can close it after return.
+    /// Data sent before and after are kept in order, onWriteComplete
+    /// is called when all are sent.
+    bool SendFile(int fd, off_t offset, std::size_t len);
+
     // 线程安全的发送数据
     bool SafeSend(const void* data, std::size_t len);
     bool SafeSend(const std::string& data);
+    ///@brief Thread-safe, no copy
+    ///
+    /// From other thread, data is pushed to a lock-free queue,
+    /// all data queued are sent by loop at once.
+    bool SafeSend(Buffer&& data);
+    bool SafeSend(IOBuf&& data);
 
     ///@brief Something internal.
     ///
@@ -76,6 +116,27 @@ class Connection : public internal::Channel { // 连接对象, 继承自Channel
     void SetOnMessage(TcpMessageCallback cb);   // 接受到数据流的回调
     void SetOnWriteComplete(TcpWriteCompleteCallback wccb); // 发送完数据流的回调
 
+    ///@brief Write backpressure
+    ///
+    /// When bytes waiting to be sent reach high, onHighWater is called once;
+    /// after they drop to low, onLowWater is called once.
+    /// Default is kDefaultLowWater and kDefaultHighWater.
+    void SetWaterMark(std::size_t low, std::size_t high);
+    void SetOnHighWater(TcpHighWaterCallback cb);
+    void SetOnLowWater(TcpLowWaterCallback cb);
+    ///@brief Stop reading from peer while over high water mark
+    ///
+    /// So peer which doesn't read our responses can't make us buffer forever.
+    void SetPauseReadOnHighWater(bool pause);
+    bool IsReadPaused() const {
+        return readPaused_;
+    }
+    ///@brief Bytes waiting to be sent, including files
+    std::size_t PendingSendBytes() const;
+
+    static const std::size_t kDefaultLowWater;
+    static const std::size_t kDefaultHighWater;
+
     ///@brief Set user's context pointer
     void SetUserData(std::shared_ptr<void> user);
 
@@ -99,9 +160,32 @@ private:
 
     friend class internal::Acceptor;
     friend class internal::Connector;
+    friend class EventLoop;
 
     void _OnConnect();
     int _Send(const void* data, size_t len);    // 发送数据
+    bool _EnableZeroCopy();
+    ssize_t _SendZeroCopy(IOBuf& buf);
+    bool _ReapZeroCopy();
+
+    bool _HasPendingSend() const {
+        return !sendBuf_.Empty() || !sendFiles_.empty();
+    }
+    // where to append data when something is waiting to be sent
+    IOBuf& _SendTail() {
+        return sendFiles_.empty() ? sendBuf_ : sendFiles_.back().trailer;
+    }
+    // send sendBuf_ and files in order, return bytes sent, kError if failed
+    ssize_t _SendPending();
+    void _ClearPending();
+
+    // events should be polled now
+    int _Interest() const;
+    void _CheckHighWater();
+    void _CheckLowWater();
+    void _ResumeRead();
+    // pass data to onMessage_ until it's not enough, return bytes consumed
+    std::size_t _OnMessage(const char* data, std::size_t len);
 
     EventLoop* const loop_;
     State state_ = State::eS_None;
@@ -109,11 +193,81 @@ private:
     size_t minPacketSize_;
 
     Buffer recvBuf_;
-    BufferVector sendBuf_;
+    IOBuf sendBuf_;
 
     bool processingRead_{false};
     bool batchSend_{true};
-    Buffer batchSendBuf_;
+    IOBuf batchSendBuf_;
+    bool dirty_{false}; // in loop's dirty list
+
+    bool _ShouldBatch() const;
+    void _MarkDirty();
+    void _FlushBatch();
+    // batched data goes before anything sent later, eg. file or FIN
+    void _MoveBatchToPending();
+
+    // MSG_ZEROCOPY, sent data is kept until kernel completes it
+    struct ZeroCopyChunk {
+        uint32_t id;
+        IOBuf data;
+    };
+    bool zcTried_{false};
+    bool zeroCopy_{false};
+    uint32_t zcNextId_{0};
+    std::deque<ZeroCopyChunk> zcPending_;
+    // return true if any completion is reaped, copied is set if kernel copied data
+    static bool _ReapZeroCopy(int sock, std::deque<ZeroCopyChunk>& pending, bool& copied);
+
+    // closed connection's socket and memory still used by kernel,
+    // loop keeps them until all completions arrive or kZeroCopyLingerTimeout.
+    // If loop is destroyed before that, socket is closed with the linger.
+    struct ZeroCopyLinger {
+        int sock;
+        std::deque<ZeroCopyChunk> pending;
+        std::chrono::steady_clock::time_point deadline;
+
+        ~ZeroCopyLinger();
+    };
+    static const std::chrono::milliseconds kZeroCopyLingerTimeout;
+    static void _LingerZeroCopy(EventLoop* loop,
+                                std::shared_ptr<ZeroCopyLinger> linger,
+                                std::chrono::milliseconds delay);
+
+    // file being sent, data appended after it is in trailer
+    struct FileChunk {
+        int fd;
+        off_t offset;
+        std::size_t len;
+        bool regular;
+        int pipe[2];
+        std::size_t inPipe; // spliced into pipe but not sent
+        IOBuf trailer;
+    };
+    std::deque<FileChunk> sendFiles_;
+    // return bytes sent, kError if failed
+    ssize_t _SendFileChunk(FileChunk& file);
+    static void _CloseFileChunk(FileChunk& file);
+    // source like pipe has no data now, watch it on loop until readable
+    bool waitFileSource_{false};
+    std::shared_ptr<internal::Channel> fileWatcher_;
+    bool _WaitFileSource(int fd);
+    void _StopWaitFileSource();
+    void _OnFileSourceReady();
+
+    // SafeSend from other threads
+    struct OutboundNode : public MpscNode {
+        IOBuf data;
+    };
+    MpscQueue<OutboundNode> outbound_;
+    // only the first SafeSend since last flush posts a flush task
+    std::atomic<bool> outboundPending_ {false};
+    void _FlushOutbound();
+
+    std::size_t lowWater_;
+    std::size_t highWater_;
+    bool pauseReadOnHighWater_{false};
+    bool overHighWater_{false};
+    bool readPaused_{false};
 
     SocketAddr peer_;
 
@@ -122,6 +276,8 @@ private:
 
     TcpMessageCallback onMessage_;  // function<size_t (Connection*, const char* data, size_t len)>
     TcpWriteCompleteCallback onWriteComplete_;
+    TcpHighWaterCallback onHighWater_;
+    TcpLowWaterCallback onLowWater_;
 
     std::shared_ptr<void> userData_;
 };
@@ -1,16 +1,47 @@
 #include <errno.h>
-#include <memory>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__gnu_linux__)
+#include <netinet/udp.h>
+#endif
 
 #include "DatagramSocket.h"
 #include "EventLoop.h"
 #include "AnanasDebug.h"
 
+#if defined(__gnu_linux__)
+#if !defined(SOL_UDP)
+#define SOL_UDP 17
+#endif
+#if !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+#if !defined(UDP_GRO)
+#define UDP_GRO 104
+#endif
+#endif
+
 namespace ananas {
 
+const std::size_t DatagramSocket::kDefaultBatchSize;
+const std::size_t DatagramSocket::kMaxBatchSize;
+const std::size_t DatagramSocket::kMaxGroSize;
+const std::size_t DatagramSocket::kMaxGroBatchSize;
+
+namespace {
+// kernel limits of one GSO send
+const std::size_t kMaxGsoSegments = 64;
+const std::size_t kMaxUdpPayload = 65507;
+}
+
 DatagramSocket::DatagramSocket(EventLoop* loop) :
     loop_(loop),
     localSock_(kInvalid),
-    maxPacketSize_(2048) {
+    maxPacketSize_(2048),
+    batchSize_(1) {
+    SetBatchSize(kDefaultBatchSize);
 }
 
 DatagramSocket::~DatagramSocket() {
@@ -32,6 +63,12 @@ bool DatagramSocket::Bind(const SocketAddr* addr) {
 
     SetNonBlock(localSock_);
     SetReuseAddr(localSock_);
+    if (reusePort_)
+        ananas::SetReusePort(localSock_);
+
+    // SetGro before Bind, packets come one by one if kernel rejects it
+    if (gro_ && !_SetGro(true))
+        gro_ = false;
 
     const bool isServer = (addr && addr->IsValid());
     if (isServer) {
@@ -63,19 +100,107 @@ int DatagramSocket::Identifier() const {
     return localSock_;
 }
 
+void DatagramSocket::SetReusePort(bool reuse) {
+    assert (localSock_ == kInvalid);
+    reusePort_ = reuse;
+}
+
+void DatagramSocket::SetMaxPacketSize(std::size_t s) {
+    assert (s > 0);
+    maxPacketSize_ = s;
+}
+
+void DatagramSocket::SetBatchSize(std::size_t n) {
+#if defined(__gnu_linux__)
+    batchSize_ = std::min(std::max<std::size_t>(n, 1), kMaxBatchSize);
+#else
+    (void)n;
+    batchSize_ = 1; // no recvmmsg
+#endif
+}
+
+
+bool DatagramSocket::SetGro(bool enable) {
+#if defined(__gnu_linux__)
+    if (localSock_ == kInvalid) {
+        gro_ = enable; // Bind will set it
+        return true;
+    }
+
+    return _SetGro(enable);
+#else
+    (void)enable;
+    return false;
+#endif
+}
+
+bool DatagramSocket::_SetGro(bool enable) {
+#if defined(__gnu_linux__)
+    int on = enable ? 1 : 0;
+    if (::setsockopt(localSock_, SOL_UDP, UDP_GRO, &on, sizeof on) != 0) {
+        ANANAS_ERR << "UDP fd " << localSock_ << " set UDP_GRO failed " << errno;
+        return false;
+    }
+
+    gro_ = enable;
+    return true;
+#else
+    (void)enable;
+    return false;
+#endif
+}
+
+std::size_t DatagramSocket::_SlotSize() const {
+    return gro_ ? std::max(maxPacketSize_, kMaxGroSize) : maxPacketSize_;
+}
+
+std::size_t DatagramSocket::_RecvBatchSize() const {
+    // GRO slot is big, and one of them already holds many packets
+    return gro_ ? std::min(batchSize_, kMaxGroBatchSize) : batchSize_;
+}
 
 bool DatagramSocket::HandleReadEvent() {
-    std::unique_ptr<char []> recvbuf(new char[maxPacketSize_]);
+    // Callbacks may change batch size or packet size, then slots are
+    // resized here and reading goes on, poller may be edge triggered.
+    while (true) {
+        char* recvbuf = _RecvSlots();
+        const bool done = (batchSize_ > 1 || gro_) ?
+                          _RecvBatch(recvbuf) :
+                          _RecvOne(recvbuf);
+        if (done)
+            return true;
+    }
+}
+
+char* DatagramSocket::_RecvSlots() {
+    // packets are passed to callback and forgotten, so slots can be reused
+    const std::size_t size = _SlotSize() * _RecvBatchSize();
+    if (recvSlotsSize_ != size) {
+        recvSlots_.reset(new char[size]);
+        recvSlotsSize_ = size;
+    }
+
+    return &recvSlots_[0];
+}
+
+bool DatagramSocket::_RecvOne(char* recvbuf) {
+    // recvbuf is sized by them
+    const std::size_t slotSize = _SlotSize();
+
     while (true) {
-        socklen_t len = sizeof srcAddr_;
+        Datagram msg;
+        socklen_t len = sizeof msg.peer;
         int bytes = ::recvfrom(localSock_,
-                               &recvbuf[0], maxPacketSize_,
+                               recvbuf, slotSize,
                                0,
-                               (struct sockaddr*)&srcAddr_, &len);
+                               (struct sockaddr*)&msg.peer, &len);
 
         if (kError == bytes && (EAGAIN == errno || EWOULDBLOCK == errno))
             return true;
 
+        if (kError == bytes && EINTR == errno)
+            continue; // drain until EAGAIN, poller may be edge triggered
+
         if (bytes <= 0) {
             ANANAS_ERR << "UDP fd " << localSock_
                        << ", HandleRead error : " << bytes
@@ -83,19 +208,156 @@ bool DatagramSocket::HandleReadEvent() {
             return true;
         }
 
-        // onMessage_ is void
-        onMessage_(this, &recvbuf[0], bytes);
+        msg.data = recvbuf;
+        msg.len = static_cast<std::size_t>(bytes);
+        _Deliver(&msg, 1);
+
+        if (batchSize_ > 1 || gro_ || slotSize != _SlotSize())
+            return false; // changed by callback
     }
 
     return  true;
 }
 
+bool DatagramSocket::_RecvBatch(char* recvbuf) {
+#if defined(__gnu_linux__)
+    mmsghdr hdrs[kMaxBatchSize];
+    iovec iovs[kMaxBatchSize];
+    Datagram msgs[kMaxBatchSize];
+    // for UDP_GRO segment size
+    char controls[kMaxBatchSize][CMSG_SPACE(sizeof(int))];
+    // recvbuf is sized by them, callbacks may change members
+    const std::size_t batch = _RecvBatchSize();
+    const std::size_t slotSize = _SlotSize();
+    const bool gro = gro_;
+
+    while (true) {
+        ::memset(hdrs, 0, sizeof(hdrs[0]) * batch);
+        for (std::size_t i = 0; i < batch; ++ i) {
+            iovs[i].iov_base = recvbuf + i * slotSize;
+            iovs[i].iov_len = slotSize;
+
+            hdrs[i].msg_hdr.msg_name = &msgs[i].peer;
+            hdrs[i].msg_hdr.msg_namelen = sizeof msgs[i].peer;
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+            if (gro) {
+                hdrs[i].msg_hdr.msg_control = controls[i];
+                hdrs[i].msg_hdr.msg_controllen = sizeof controls[i];
+            }
+        }
+
+        int n = ::recvmmsg(localSock_, hdrs, static_cast<unsigned int>(batch), 0, nullptr);
+        if (kError == n && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return true;
+
+        if (kError == n && EINTR == errno)
+            continue; // drain until EAGAIN, poller may be edge triggered
+
+        if (n <= 0) {
+            ANANAS_ERR << "UDP fd " << localSock_
+                       << ", HandleRead error : " << n
+                       << ", errno = " << errno;
+            return true;
+        }
+
+        for (int i = 0; i < n; ++ i) {
+            msgs[i].data = recvbuf + i * slotSize;
+            msgs[i].len = hdrs[i].msg_len;
+        }
+
+        if (!gro) {
+            _Deliver(msgs, static_cast<std::size_t>(n));
+        } else {
+            _DeliverGro(hdrs, msgs, static_cast<std::size_t>(n));
+        }
+
+        if (batch != _RecvBatchSize() || slotSize != _SlotSize() || gro != gro_)
+            return false; // changed by callback
+    }
+
+    return true;
+#else
+    return _RecvOne(recvbuf);
+#endif
+}
+
+#if defined(__gnu_linux__)
+void DatagramSocket::_DeliverGro(mmsghdr* hdrs, const Datagram* msgs, std::size_t count) {
+
+    // split coalesced packets
+    groMsgs_.clear();
+    for (std::size_t i = 0; i < count; ++ i) {
+        std::size_t segSize = 0;
+        msghdr& hdr = hdrs[i].msg_hdr;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size = 0;
+                ::memcpy(&size, CMSG_DATA(cm), sizeof size);
+                segSize = static_cast<std::size_t>(size);
+            }
+        }
+
+        if (segSize == 0 || segSize >= msgs[i].len) {
+            groMsgs_.push_back(msgs[i]);
+            continue;
+        }
+
+        for (std::size_t off = 0; off < msgs[i].len; off += segSize) {
+            Datagram seg = msgs[i];
+            seg.data += off;
+            seg.len = std::min(segSize, msgs[i].len - off);
+            groMsgs_.push_back(seg);
+        }
+    }
+
+    _Deliver(groMsgs_.data(), groMsgs_.size());
+}
+#endif
+
+void DatagramSocket::_Deliver(const Datagram* msgs, std::size_t count) {
+    if (onBatchMessage_) {
+        srcAddr_ = msgs[count - 1].peer;
+        onBatchMessage_(this, msgs, count);
+        return;
+    }
+
+    for (std::size_t i = 0; i < count; ++ i) {
+        srcAddr_ = msgs[i].peer; // for PeerAddr and SendPacket
+        if (onMessage_)
+            onMessage_(this, msgs[i].data, msgs[i].len);
+    }
+}
+
 void DatagramSocket::_PutSendBuf(const void* data, size_t size, const SocketAddr* dst) {
-    Package pkg;
+    if (sendCount_ == sendRing_.size()) {
+        // full, move to a bigger ring
+        std::vector<Package> ring(std::max<std::size_t>(16, sendRing_.size() * 2));
+        for (std::size_t i = 0; i < sendCount_; ++ i)
+            ring[i] = std::move(_QueuedAt(i));
+
+        sendRing_.swap(ring);
+        sendHead_ = 0;
+    }
+
+    std::size_t blockSize = size;
+    char* block = BufferPool::Allocate(blockSize);
+    ::memcpy(block, data, size);
+
+    Package& pkg = sendRing_[(sendHead_ + sendCount_) % sendRing_.size()];
     pkg.dst = *dst;
-    pkg.data.assign(reinterpret_cast<const char* >(data), size);
+    pkg.data = std::unique_ptr<char [], internal::PoolDeleter>(block, internal::PoolDeleter(blockSize));
+    pkg.len = size;
+
+    ++ sendCount_;
+}
+
+void DatagramSocket::_PopQueued() {
+    assert (sendCount_ > 0);
 
-    sendList_.emplace_back(std::move(pkg));
+    _QueuedAt(0).data.reset(); // back to pool
+    sendHead_ = (sendHead_ + 1) % sendRing_.size();
+    -- sendCount_;
 }
 
 int DatagramSocket::_Send(const void* data, size_t size, const SocketAddr& dst) {
@@ -119,7 +381,7 @@ bool DatagramSocket::SendPacket(const void* data, size_t size, const SocketAddr*
     if (!dst)
         dst = &srcAddr_;
 
-    if (!sendList_.empty()) {
+    if (sendCount_ > 0) {
         _PutSendBuf(data, size, dst);
         return true;
     }
@@ -139,24 +401,205 @@ bool DatagramSocket::SendPacket(const void* data, size_t size, const SocketAddr*
     return true;
 }
 
-bool DatagramSocket::HandleWriteEvent() {
-    while (!sendList_.empty()) {
-        const auto& pkg = sendList_.front();
+bool DatagramSocket::SendPackets(const Datagram* msgs, std::size_t count) {
+    if (count == 0 || !msgs)
+        return true;
 
-        int bytes = _Send(pkg.data.data(), pkg.data.size(), pkg.dst);
-        if (bytes == 0) {
+    std::size_t done = 0;
+    if (sendCount_ == 0) {
+        done = _SendBatch(msgs, count);
+        if (done == count)
             return true;
-        } else if (bytes > 0) {
-            sendList_.pop_front();
-        } else {
+
+        loop_->Modify(internal::eET_Read | internal::eET_Write, shared_from_this());
+    }
+
+    for (; done < count; ++ done)
+        _PutSendBuf(msgs[done].data, msgs[done].len, &msgs[done].peer);
+
+    return true;
+}
+
+bool DatagramSocket::SendPacketSegmented(const void* data, size_t len, size_t segSize,
+                                         const SocketAddr* dst) {
+    if (len == 0 || !data)
+        return true;
+
+    if (!dst)
+        dst = &srcAddr_;
+
+    if (segSize == 0 || segSize >= len)
+        return SendPacket(data, len, dst);
+
+    if (segSize > kMaxUdpPayload) {
+        ANANAS_ERR << "UDP segment size too big " << segSize;
+        return false;
+    }
+
+    const char* const begin = reinterpret_cast<const char* >(data);
+#if defined(__gnu_linux__)
+    if (gso_ && sendCount_ == 0) {
+        // one GSO send can not exceed max udp payload and segments limit
+        const std::size_t maxChunk = std::min(kMaxGsoSegments, kMaxUdpPayload / segSize) * segSize;
+
+        std::size_t off = 0;
+        while (off < len) {
+            const std::size_t chunk = std::min(len - off, maxChunk);
+
+            iovec iov;
+            iov.iov_base = const_cast<char*>(begin + off);
+            iov.iov_len = chunk;
+
+            char control[CMSG_SPACE(sizeof(uint16_t))];
+            ::memset(control, 0, sizeof control);
+
+            msghdr msg;
+            ::memset(&msg, 0, sizeof msg);
+            msg.msg_name = const_cast<SocketAddr*>(dst);
+            msg.msg_namelen = sizeof *dst;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof control;
+
+            cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const uint16_t gsoSize = static_cast<uint16_t>(segSize);
+            ::memcpy(CMSG_DATA(cm), &gsoSize, sizeof gsoSize);
+
+            if (::sendmsg(localSock_, &msg, 0) == kError) {
+                if (EINTR == errno)
+                    continue;
+
+                if (EAGAIN == errno || EWOULDBLOCK == errno)
+                    break; // queue the left
+
+                if (off == 0 && (EIO == errno || EINVAL == errno || ENOPROTOOPT == errno ||
+                                 EOPNOTSUPP == errno)) {
+                    ANANAS_WRN << "UDP fd " << localSock_ << " GSO not supported, errno " << errno;
+                    gso_ = false;
+                    break;
+                }
+
+                ANANAS_ERR << "Fatal error when send udp to "
+                           << dst->ToString()
+                           << ", must skip it";
+                return false;
+            }
+
+            off += chunk;
+        }
+
+        if (off == len)
+            return true;
+
+        return _SendSegments(begin + off, len - off, segSize, *dst);
+    }
+#endif
+
+    return _SendSegments(begin, len, segSize, *dst);
+}
+
+bool DatagramSocket::_SendSegments(const char* data, size_t len, size_t segSize,
+                                   const SocketAddr& dst) {
+    Datagram msgs[kMaxBatchSize];
+    std::size_t n = 0;
+    for (std::size_t off = 0; off < len; off += segSize) {
+        msgs[n].data = data + off;
+        msgs[n].len = std::min(segSize, len - off);
+        msgs[n].peer = dst;
+
+        if (++ n == kMaxBatchSize) {
+            SendPackets(msgs, n);
+            n = 0;
+        }
+    }
+
+    return SendPackets(msgs, n);
+}
+
+std::size_t DatagramSocket::_SendBatch(const Datagram* msgs, std::size_t count) {
+    std::size_t done = 0;
+
+#if defined(__gnu_linux__)
+    if (batchSize_ > 1) {
+        mmsghdr hdrs[kMaxBatchSize];
+        iovec iovs[kMaxBatchSize];
+
+        while (done < count) {
+            const std::size_t n = std::min(count - done, batchSize_);
+            ::memset(hdrs, 0, sizeof(hdrs[0]) * n);
+            for (std::size_t i = 0; i < n; ++ i) {
+                const Datagram& msg = msgs[done + i];
+                iovs[i].iov_base = const_cast<char*>(msg.data);
+                iovs[i].iov_len = msg.len;
+
+                hdrs[i].msg_hdr.msg_name = const_cast<SocketAddr*>(&msg.peer);
+                hdrs[i].msg_hdr.msg_namelen = sizeof msg.peer;
+                hdrs[i].msg_hdr.msg_iov = &iovs[i];
+                hdrs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int sent = ::sendmmsg(localSock_, hdrs, static_cast<unsigned int>(n), 0);
+            if (kError == sent) {
+                if (EAGAIN == errno || EWOULDBLOCK == errno)
+                    break;
+
+                if (EINTR == errno)
+                    continue;
+
+                // error is for the first one
+                ANANAS_ERR << "Fatal error when send udp to "
+                           << msgs[done].peer.ToString()
+                           << ", must skip it";
+                sent = 1;
+            }
+
+            done += static_cast<std::size_t>(sent);
+        }
+
+        return done;
+    }
+#endif
+
+    for (; done < count; ++ done) {
+        const Datagram& msg = msgs[done];
+        int bytes = _Send(msg.data, msg.len, msg.peer);
+        if (bytes == 0)
+            break;
+
+        if (bytes < 0) {
             ANANAS_ERR << "Fatal error when send udp to "
-                       << pkg.dst.ToString()
+                       << msg.peer.ToString()
                        << ", must skip it";
-            sendList_.pop_front();
         }
     }
 
-    if (sendList_.empty())
+    return done;
+}
+
+bool DatagramSocket::HandleWriteEvent() {
+    Datagram msgs[kMaxBatchSize];
+    while (sendCount_ > 0) {
+        const std::size_t n = std::min(sendCount_, batchSize_);
+        for (std::size_t i = 0; i < n; ++ i) {
+            Package& pkg = _QueuedAt(i);
+            msgs[i].data = pkg.data.get();
+            msgs[i].len = pkg.len;
+            msgs[i].peer = pkg.dst;
+        }
+
+        const std::size_t done = _SendBatch(msgs, n);
+        for (std::size_t i = 0; i < done; ++ i)
+            _PopQueued();
+
+        if (done < n)
+            return true; // would block
+    }
+
+    if (sendCount_ == 0)
         loop_->Modify(internal::eET_Read, shared_from_this());
 
     return true;
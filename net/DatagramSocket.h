@@ -2,15 +2,24 @@
 #ifndef BERT_DATAGRAMSOCKET_H
 #define BERT_DATAGRAMSOCKET_H
 
-#include <list>
+#include <memory>
+#include <vector>
 #include "Socket.h"
 #include "Typedefs.h"
 #include "Poller.h"
+#include "ananas/util/BufferPool.h"
 
 namespace ananas {
 
 class EventLoop;
 
+///@brief One UDP packet and its peer
+struct Datagram {
+    const char* data;
+    std::size_t len;
+    SocketAddr peer;
+};
+
 class DatagramSocket : public internal::Channel {
 public:
     explicit
@@ -20,7 +29,10 @@ public:
     DatagramSocket(const DatagramSocket& ) = delete;
     void operator= (const DatagramSocket& ) = delete;
 
+    ///@brief Max size of received packet, default 2048
     void SetMaxPacketSize(std::size_t s);
+    ///@brief Bind with SO_REUSEPORT, call it before Bind
+    void SetReusePort(bool reuse);
     bool Bind(const SocketAddr* addr);
 
     int Identifier() const override;
@@ -29,10 +41,44 @@ public:
     void HandleErrorEvent() override;
 
     bool SendPacket(const void*, size_t, const SocketAddr* = nullptr);
+    ///@brief Send many packets by sendmmsg, linux only
+    ///
+    /// Packets can not be sent now are queued, like SendPacket.
+    /// Packet failed with fatal error is skipped.
+    bool SendPackets(const Datagram* msgs, std::size_t count);
+
+    ///@brief Send data as packets of segSize bytes by UDP GSO, linux only
+    ///
+    /// Kernel splits data, the last packet may be shorter.
+    /// Without GSO support, packets are split here and sent by SendPackets.
+    bool SendPacketSegmented(const void* data, size_t len, size_t segSize,
+                             const SocketAddr* dst = nullptr);
+    ///@brief Receive coalesced packets by UDP GRO, linux only
+    ///
+    /// They are split again before passed to message callback.
+    /// Each receive slot becomes kMaxGroSize bytes, so at most
+    /// kMaxGroBatchSize slots are received at once, that's 512KB per socket.
+    /// If called before Bind, it's set by Bind, packets are not coalesced
+    /// if kernel rejects it then.
+    bool SetGro(bool enable);
+    static const std::size_t kMaxGroSize = 65536;
+    static const std::size_t kMaxGroBatchSize = 8;
+
+    ///@brief Max packets received or sent by one recvmmsg/sendmmsg
+    ///
+    /// Default is kDefaultBatchSize, at most kMaxBatchSize,
+    /// 1 to use recvfrom/sendto.
+    void SetBatchSize(std::size_t n);
+    static const std::size_t kDefaultBatchSize = 32;
+    static const std::size_t kMaxBatchSize = 64;
 
     const SocketAddr& PeerAddr() const {
         return srcAddr_;
     }
+    ///@brief Packets waiting to be sent
+    std::size_t QueuedPackets() const {
+        return sendCount_;
+    }
 
     void SetMessageCallback(UDPMessageCallback mcb) {
         onMessage_ = std::move(mcb);
@@ -40,24 +86,66 @@ public:
     void SetCreateCallback(UDPCreateCallback ccb) {
         onCreate_ = std::move(ccb);
     }
+    ///@brief Receive packets of one recvmmsg at once, instead of MessageCallback
+    void SetBatchMessageCallback(UDPBatchMessageCallback bcb) {
+        onBatchMessage_ = std::move(bcb);
+    }
 
 private:
     void _PutSendBuf(const void* data, size_t size, const SocketAddr* dst);
     int _Send(const void* data, size_t size, const SocketAddr& dst);
+    // receive slots, allocated once and reused by every read
+    char* _RecvSlots();
+    // false if callback changed batch or packet size, read again with new slots
+    bool _RecvOne(char* buf);
+    bool _RecvBatch(char* buf);
+    void _Deliver(const Datagram* msgs, std::size_t count);
+#if defined(__gnu_linux__)
+    // split packets coalesced by UDP_GRO, then deliver
+    void _DeliverGro(struct mmsghdr* hdrs, const Datagram* msgs, std::size_t count);
+#endif
+    // return count sent or skipped, stop when would block
+    std::size_t _SendBatch(const Datagram* msgs, std::size_t count);
+    // split here and SendPackets
+    bool _SendSegments(const char* data, size_t len, size_t segSize, const SocketAddr& dst);
+    std::size_t _SlotSize() const;
+    std::size_t _RecvBatchSize() const;
+    bool _SetGro(bool enable);
 
     EventLoop* const loop_;
     int localSock_;
     std::size_t maxPacketSize_;
+    std::size_t batchSize_;
     SocketAddr srcAddr_;
+    bool reusePort_ {false};
 
+    std::unique_ptr<char []> recvSlots_;
+    std::size_t recvSlotsSize_ {0};
+
+    bool gso_ {true}; // false if kernel rejected it
+    bool gro_ {false};
+    // packets split from GRO, reused
+    std::vector<Datagram> groMsgs_;
+
+    // packets can not be sent now, data memory is from BufferPool
     struct Package {
         SocketAddr dst;
-        std::string data;
+        std::unique_ptr<char [], internal::PoolDeleter> data;
+        std::size_t len {0};
     };
-    std::list<Package> sendList_;
+    // ring buffer, only grows when full
+    std::vector<Package> sendRing_;
+    std::size_t sendHead_ {0};
+    std::size_t sendCount_ {0};
+
+    Package& _QueuedAt(std::size_t i) {
+        return sendRing_[(sendHead_ + i) % sendRing_.size()];
+    }
+    void _PopQueued();
 
     UDPMessageCallback onMessage_;
     UDPCreateCallback onCreate_;
+    UDPBatchMessageCallback onBatchMessage_;
 };
 
 } // namespace ananas
@@ -11,20 +11,29 @@ namespace ananas {
 namespace internal {
 
 namespace Epoll {
-bool ModSocket(int epfd, int socket, uint32_t events, void* ptr);
+bool ModSocket(int epfd, int socket, uint32_t events);
 
-bool AddSocket(int epfd, int socket, uint32_t events, void* ptr) {  // epoll注册socket
+uint32_t ToEpollEvents(int events, bool et) {
+    uint32_t epollEvents = 0;
+    if (events & eET_Read)  // 设置事件
+        epollEvents |= EPOLLIN;
+    if (events & eET_Write)
+        epollEvents |= EPOLLOUT;
+    if (et)
+        epollEvents |= EPOLLET;
+
+    return epollEvents;
+}
+
+// data is fd, the user pointer is in interest cache
+bool AddSocket(int epfd, int socket, uint32_t events) {  // epoll注册socket
     if (socket < 0)
         return false;
 
     epoll_event  ev;
-    ev.data.ptr= ptr;
-    ev.events = 0;
-
-    if (events & eET_Read)  // 设置事件
-        ev.events |= EPOLLIN;
-    if (events & eET_Write)
-        ev.events |= EPOLLOUT;
+    ev.data.u64 = 0;
+    ev.data.fd = socket;
+    ev.events = events;
 
     return 0 == epoll_ctl(epfd, EPOLL_CTL_ADD, socket, &ev);    // epoll_ctl注册socket, event到 epfd
 }
@@ -37,18 +46,14 @@ bool DelSocket(int epfd, int socket) {
     return 0 == epoll_ctl(epfd, EPOLL_CTL_DEL, socket, &dummy) ;
 }
 
-bool ModSocket(int epfd, int socket, uint32_t events, void* ptr) {  // 修改socket, event类型epoll_ctl
+bool ModSocket(int epfd, int socket, uint32_t events) {  // 修改socket, event类型epoll_ctl
     if (socket < 0)
         return false;
 
     epoll_event  ev;
-    ev.data.ptr= ptr;
-    ev.events = 0;
-
-    if (events & eET_Read)
-        ev.events |= EPOLLIN;
-    if (events & eET_Write)
-        ev.events |= EPOLLOUT;
+    ev.data.u64 = 0;
+    ev.data.fd = socket;
+    ev.events = events;
 
     return 0 == epoll_ctl(epfd, EPOLL_CTL_MOD, socket, &ev);
 }
@@ -67,14 +72,52 @@ Epoller::~Epoller() {
     }
 }
 
+bool Epoller::SetEdgeTriggered(bool et) {
+    for (const auto& it : interests_) {
+        if (it.armed != 0) {
+            ANANAS_ERR << "Can not change trigger mode after fd registered";
+            return false;
+        }
+    }
+
+    edgeTriggered_ = et;
+    return true;
+}
+
+Epoller::Interest* Epoller::_GetInterest(int fd) {
+    if (fd < 0)
+        return nullptr;
+
+    if (static_cast<std::size_t>(fd) >= interests_.size())
+        interests_.resize(fd + 1);
+
+    return &interests_[fd];
+}
+
 bool Epoller::Register(int fd, int events, void* userPtr) { // 新增socket于epoll中
-    if (Epoll::AddSocket(multiplexer_, fd, events, userPtr))
+    Interest* it = _GetInterest(fd);
+    if (!it)
+        return false;
+
+    if (it->armed != 0)
+        return Modify(fd, events, userPtr);
+
+    const uint32_t epollEvents = Epoll::ToEpollEvents(events, edgeTriggered_);
+    if (Epoll::AddSocket(multiplexer_, fd, epollEvents) ||
+        (errno == EEXIST && Epoll::ModSocket(multiplexer_, fd, epollEvents))) {
+        it->userPtr = userPtr;
+        it->wanted = it->armed = events;
         return true;
+    }
 
-    return (errno == EEXIST) && Modify(fd, events, userPtr);
+    return false;
 }
 
 bool Epoller::Unregister(int fd, int events) {
+    Interest* it = _GetInterest(fd);
+    if (it)
+        *it = Interest();
+
     return Epoll::DelSocket(multiplexer_, fd);
 }
 
@@ -83,9 +126,34 @@ bool Epoller::Modify(int fd, int events, void* userPtr) {
     if (events == 0)
         return Unregister(fd, 0);
 
-    if (Epoll::ModSocket(multiplexer_, fd, events, userPtr))
+    Interest* it = _GetInterest(fd);
+    if (!it)
+        return false;
+
+    if (it->armed == 0)
+        return Register(fd, events, userPtr);
+
+    if (it->userPtr == userPtr) {
+        // Level triggered: kernel must have exactly the wanted events,
+        // otherwise EPOLLOUT will fire forever.
+        // Edge triggered: extra armed events are harmless, they are filtered
+        // in Poll; but new events must re-arm so that ready fd fires at once.
+        const bool same = edgeTriggered_ ? (events & ~it->armed) == 0
+                                         : events == it->armed;
+        if (same) {
+            it->wanted = events;
+            ++ skippedModifies_;
+            return true;
+        }
+    }
+
+    if (Epoll::ModSocket(multiplexer_, fd, Epoll::ToEpollEvents(events, edgeTriggered_))) {
+        it->userPtr = userPtr;
+        it->wanted = it->armed = events;
         return  true;
+    }
 
+    *it = Interest();
     return  errno == ENOENT && Register(fd, events, userPtr);
 }
 
@@ -105,22 +173,36 @@ int Epoller::Poll(size_t maxEvent, int timeoutMs) { // 获取活跃事件
     if (nFired > 0)
         events.resize(nFired);
 
+    int nValid = 0;
     for (int i = 0; i < nFired; ++ i) {
-        FiredEvent& fired = events[i];  // fired是events[]的引用, 这一切都是在修改std::vector<FiredEvent> firedEvents_;
-        fired.events   = 0;
-        fired.userdata = events_[i].data.ptr;
+        const int fd = events_[i].data.fd;
+        const Interest& it = interests_[fd];
+        if (it.armed == 0)
+            continue; // unregistered
 
+        int firedEvents = 0;
         if (events_[i].events & EPOLLIN)
-            fired.events  |= eET_Read;
+            firedEvents |= eET_Read;
 
         if (events_[i].events & EPOLLOUT)
-            fired.events  |= eET_Write;
+            firedEvents |= eET_Write;
+
+        // drop events armed lazily but not wanted any more
+        firedEvents &= it.wanted;
 
         if (events_[i].events & (EPOLLERR | EPOLLHUP))
-            fired.events  |= eET_Error;
+            firedEvents |= eET_Error;
+
+        if (firedEvents == 0)
+            continue;
+
+        FiredEvent& fired = events[nValid ++];  // fired是events[]的引用, 这一切都是在修改std::vector<FiredEvent> firedEvents_;
+        fired.events   = firedEvents;
+        fired.fd       = fd;
+        fired.userdata = it.userPtr;
     }
 
-    return nFired;
+    return nValid;
 }
 
 } // namespace internal
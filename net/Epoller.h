@@ -24,8 +24,21 @@ public:
 
     int Poll(std::size_t maxEvent, int timeoutMs) override;
 
+    bool SetEdgeTriggered(bool et) override;
+
 private:
+    // Interest cache of fd, so redundant epoll_ctl can be skipped
+    struct Interest {
+        void* userPtr {nullptr};
+        int wanted {0};   // events wanted by channel
+        int armed {0};    // events in kernel, 0 means not registered
+    };
+
+    Interest* _GetInterest(int fd);
+
     std::vector<epoll_event> events_;   // 用vector维护的事件列表
+    std::vector<Interest> interests_;   // index by fd
+    bool edgeTriggered_ {false};
 };
 
 } // namespace internal
@@ -1,5 +1,7 @@
 
+#include <algorithm>
 #include <cassert>
+#include <limits>
 #include <thread>
 
 #include "EventLoop.h"
@@ -14,6 +16,8 @@
 #include "Kqueue.h"
 #elif defined(__gnu_linux__)
 #include "Epoller.h"
+#include "IoUring.h"
+#include "TimerChannel.h"
 #else
 #error "Only support osx and linux"
 #endif
@@ -34,43 +38,42 @@ void EventLoop::SetMaxOpenFd(rlim_t maxfdPlus1) {
         s_maxOpenFdPlus1 = maxfdPlus1;
 }
 
-EventLoop::EventLoop() {
+EventLoop::EventLoop(PollerType type) {
     assert (!g_thisLoop && "There must be only one EventLoop per thread");
     g_thisLoop = this;
 
     internal::InitDebugLog(logALL);
 
-#if defined(__APPLE__)
-    poller_.reset(new internal::Kqueue);
-#elif defined(__gnu_linux__)
-    poller_.reset(new internal::Epoller);
-#else
-#error "Only support mac os and linux"
-#endif
+    SetPollerType(type);
 
     notifier_ = std::make_shared<internal::PipeChannel>();
     id_ = s_evId ++;
 }
 
 EventLoop::~EventLoop() {
+    while (Task* task = tasks_.Pop())
+        delete task;
 }
 
 bool EventLoop::Listen(const char* ip,
                        uint16_t hostPort,
-                       NewTcpConnCallback newConnCallback) {
+                       NewTcpConnCallback newConnCallback,
+                       bool reusePort) {
     SocketAddr addr;
     addr.Init(ip, hostPort);
 
-    return Listen(addr, std::move(newConnCallback));
+    return Listen(addr, std::move(newConnCallback), reusePort);
 }
 
 // eventloop的监听, 先创建一个Acceptor, 配置回调函数和Bind, Bind这里包括bind和listen
 bool EventLoop::Listen(const SocketAddr& listenAddr,
-                       NewTcpConnCallback newConnCallback) {
+                       NewTcpConnCallback newConnCallback,
+                       bool reusePort) {
     using internal::Acceptor;
 
     auto s = std::make_shared<Acceptor>(this);// 创建Accptor对象, 指针用shared_ptr维护
     s->SetNewConnCallback(std::move(newConnCallback));  // 设置连接回调
+    s->SetReusePort(reusePort);
     if (!s->Bind(listenAddr))
         return false;
 
@@ -79,10 +82,12 @@ bool EventLoop::Listen(const SocketAddr& listenAddr,
 
 bool EventLoop::ListenUDP(const SocketAddr& listenAddr,
                           UDPMessageCallback mcb,
-                          UDPCreateCallback ccb) {  // UDP设置回调函数, bin
+                          UDPCreateCallback ccb,
+                          bool reusePort) {  // UDP设置回调函数, bin
     auto s = std::make_shared<DatagramSocket>(this);    
     s->SetMessageCallback(mcb);
     s->SetCreateCallback(ccb);
+    s->SetReusePort(reusePort);
     if (!s->Bind(&listenAddr))
         return false;
 
@@ -91,11 +96,12 @@ bool EventLoop::ListenUDP(const SocketAddr& listenAddr,
 
 bool EventLoop::ListenUDP(const char* ip, uint16_t hostPort,
                           UDPMessageCallback mcb,
-                          UDPCreateCallback ccb) {
+                          UDPCreateCallback ccb,
+                          bool reusePort) {
     SocketAddr addr;
     addr.Init(ip, hostPort);
 
-    return ListenUDP(addr, mcb, ccb);
+    return ListenUDP(addr, mcb, ccb, reusePort);
 }
 
 
@@ -147,6 +153,56 @@ std::atomic<int> EventLoop::s_evId {0};
 
 rlim_t EventLoop::s_maxOpenFdPlus1 = ananas::GetMaxOpenFd();
 
+bool EventLoop::SetPollerType(PollerType type) {
+    if (Size() != 0) {
+        ANANAS_ERR << "Can not change poller after channel registered";
+        return false;
+    }
+
+#if defined(__APPLE__)
+    poller_.reset(new internal::Kqueue);
+    type = PollerType::ePT_Default;
+#elif defined(__gnu_linux__)
+    if (type == PollerType::ePT_IoUring) {
+        std::unique_ptr<internal::IoUring> uring(new internal::IoUring);
+        if (uring->IsValid()) {
+            poller_ = std::move(uring);
+        } else {
+            ANANAS_WRN << "io_uring is not available, use epoll";
+            type = PollerType::ePT_Default;
+        }
+    }
+
+    if (type == PollerType::ePT_Default)
+        poller_.reset(new internal::Epoller);
+#else
+#error "Only support mac os and linux"
+#endif
+
+    pollerType_ = type;
+    if (edgeTriggered_)
+        poller_->SetEdgeTriggered(true);
+
+    return true;
+}
+
+bool EventLoop::SetEdgeTriggered(bool et) {
+    if (Size() != 0) {
+        ANANAS_ERR << "Can not change trigger mode after channel registered";
+        return false;
+    }
+
+    if (!poller_->SetEdgeTriggered(et))
+        return false;
+
+    edgeTriggered_ = et;
+    return true;
+}
+
+std::size_t EventLoop::SkippedModifies() const {
+    return poller_ ? poller_->SkippedModifies() : 0;
+}
+
 bool EventLoop::Register(int events, std::shared_ptr<internal::Channel> src) {  // 注册一个events，Channel到poll
     if (events == 0)
         return false;
@@ -176,94 +232,177 @@ bool EventLoop::Register(int events, std::shared_ptr<internal::Channel> src) {
     src->SetUniqueId(s_id);
     ANANAS_INF << "Register " << s_id << " to me " << pthread_self();
 
-    if (poller_->Register(src->Identifier(), events, src.get()))    // 注册Channel到poller_
-        return channelSet_.insert({src->GetUniqueId(), src}).second;    // 成功插入channelSet
+    const int fd = src->Identifier();
+    if (fd < 0)
+        return false;
+
+    if (static_cast<std::size_t>(fd) >= channels_.size())
+        channels_.resize(std::max<std::size_t>(fd + 1, 2 * channels_.size()));
 
-    return false;
+    if (channels_[fd]) {
+        ANANAS_ERR << "Register failed! fd " << fd << " is already registered";
+        return false;
+    }
+
+    if (!poller_->Register(fd, events, src.get()))    // 注册Channel到poller_
+        return false;
+
+    channels_[fd] = std::move(src);
+    nChannels_.fetch_add(1, std::memory_order_relaxed);
+    return true;
 }
 
 bool EventLoop::Modify(int events, std::shared_ptr<internal::Channel> src) {    // 修改poller的event和fd
-    assert (channelSet_.count(src->GetUniqueId()));
+    assert (_GetChannel(src->Identifier()) == src.get());
     return poller_->Modify(src->Identifier(), events, src.get());
 }
 
 void EventLoop::Unregister(int events, std::shared_ptr<internal::Channel> src) {
     const int fd = src->Identifier();
     ANANAS_INF << "Unregister socket id " << fd;
-    poller_->Unregister(fd, events);
 
-    size_t nTask = channelSet_.erase(src->GetUniqueId());
-    if (nTask != 1) {
+    if (_GetChannel(fd) != src.get()) {
         ANANAS_ERR << "Can not find socket id " << fd;
         assert (false);
+        return;
     }
+
+    poller_->Unregister(fd, events);
+
+    if (dispatching_)
+        graveyard_.push_back(std::move(channels_[fd]));
+    else
+        channels_[fd].reset();
+
+    nChannels_.fetch_sub(1, std::memory_order_relaxed);
 }
 
 bool EventLoop::Cancel(TimerId id) {
     return timers_.Cancel(id);
 }
 
+bool EventLoop::SetHighResolutionTimer(bool enable) {
+#if defined(__gnu_linux__)
+    if (timerChannel_) {
+        ANANAS_ERR << "Can not change timer resolution after Run";
+        return false;
+    }
+
+    highResTimer_ = enable;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+bool EventLoop::SetTimerMode(TimerMode mode) {
+    if (!timers_.SetMode(mode)) {
+        ANANAS_ERR << "Can not change timer mode when there are timers";
+        return false;
+    }
+
+    return true;
+}
+
 void EventLoop::Run() { // 主循环
     assert (this->InThisLoop());
 
-    const DurationMs kDefaultPollTime(10);
-    const DurationMs kMinPollTime(1);
-
     Register(internal::eET_Read, notifier_);   // notifier channel注册可读到poller中, 这个用来唤醒epoll_wait 
 
+#if defined(__gnu_linux__)
+    if (highResTimer_) {
+        timerChannel_ = std::make_shared<internal::TimerChannel>();
+        if (!timerChannel_->IsValid() || !Register(internal::eET_Read, timerChannel_)) {
+            ANANAS_WRN << "timerfd is not available, use poll timeout";
+            timerChannel_.reset();
+        }
+    }
+#endif
+
     // 主循环,执行_Loop
+    auto last = std::chrono::steady_clock::now();
     while (!Application::Instance().IsExit()) {
-        auto timeout = std::min(kDefaultPollTime, timers_.NearestTimer());
-        timeout = std::max(kMinPollTime, timeout);
+        _Loop(_PollTimeout());// 这个思想和redis类似, 在timeout时间下执行loop循环, 等超时了执行定时器
 
-        _Loop(timeout);// 这个思想和redis类似, 在timeout时间下执行loop循环, 等超时了执行定时器
+        const auto now = std::chrono::steady_clock::now();
+        _UpdateLoad(now - last - idle_, now - last);
+        last = now;
     }
 
-    for (auto& kv : channelSet_) {  // 取消所有channelSet 
-        poller_->Unregister(internal::eET_Read | internal::eET_Write,
-                            kv.second->Identifier());
+    for (auto& ch : channels_) {  // 取消所有channel
+        if (ch)
+            poller_->Unregister(ch->Identifier(),
+                                internal::eET_Read | internal::eET_Write);
     }
 
-    channelSet_.clear();
+    channels_.clear();
+    nChannels_ = 0;
     poller_.reset();
 }
 
-bool EventLoop::_Loop(DurationMs timeout) { // 一个loop循环
+int EventLoop::_PollTimeout() {
+    const TimePoint deadline = timers_.NearestDeadline();
+
+#if defined(__gnu_linux__)
+    // timerfd or notifier will wake me up; if it can't be armed, use timeout
+    if (timerChannel_ && timerChannel_->Arm(deadline))
+        return -1;
+#endif
+
+    // No timer, wait until events or Wakeup
+    if (deadline == TimePoint::max())
+        return -1;
+
+    const auto now = std::chrono::steady_clock::now();
+    if (deadline <= now)
+        return 0;
+
+    // round up, poll timeout is in milliseconds
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+    const auto ms = (us + 999) / 1000;
+    return static_cast<int>(std::min<decltype(ms)>(ms, std::numeric_limits<int>::max()));
+}
+
+bool EventLoop::_Loop(int timeoutMs) { // 一个loop循环
     ANANAS_DEFER {
         timers_.Update();   // 优先处理定时器, 保证不超时
 
         // do not block, 再处理任务队列的函数
-        if (fctrMutex_.try_lock()) {
-            // Use tmp : if f add callback to functors_
-            decltype(functors_) funcs;
-            funcs.swap(functors_);
-            fctrMutex_.unlock();
-
-            for (const auto& f : funcs) // 执行
-                f();
-        }
+        _RunTasks();
+
+        // at last, send data deferred by all above
+        _FlushDirty();
     };
 
-    if (channelSet_.empty()) {
-        std::this_thread::sleep_for(timeout);
+    // time blocked in poll, for load estimation
+    const auto pollStart = std::chrono::steady_clock::now();
+
+    const std::size_t nChannels = Size();
+    if (nChannels == 0) {
+        std::this_thread::sleep_for(timeoutMs < 0 ? DurationMs(10) : DurationMs(timeoutMs));
+        idle_ = std::chrono::steady_clock::now() - pollStart;
         return false;
     }
 
     // muduo是把定时器timefd和pollfd统一处理, 这里只处理pollfd, 为了不超定时器的时间, 等之前设置epoll_wait最长等待时间不超过定时器最早时间
-    const int ready = poller_->Poll(static_cast<int>(channelSet_.size()),
-                                    static_cast<int>(timeout.count())); // 等待活跃channel, 设置超时时间为timeout
+    const int ready = busyPollBudget_.count() > 0 ?
+                      _BusyPoll(nChannels, timeoutMs) :
+                      poller_->Poll(nChannels, timeoutMs); // 等待活跃channel, 设置超时时间为timeout
+    idle_ = std::chrono::steady_clock::now() - pollStart;
     if (ready < 0)
         return false;
 
     
     const auto& fired = poller_->GetFiredEvents();  // 得到活跃的事件
 
-    // Consider stale event, DO NOT unregister another socket in event handler!
-
-    std::vector<std::shared_ptr<internal::Channel>> sources(ready); // 处理活跃的events, 
+    // Channels unregistered by handlers go to graveyard_, so every channel
+    // seen in this iteration stays alive; a fired event is stale if its fd
+    // slot is now empty or owned by another channel.
+    dispatching_ = true;
     for (int i = 0; i < ready; ++ i) {
         auto src = (internal::Channel* )fired[i].userdata;  // src是一个channel
-        sources[i] = src->shared_from_this();
+        if (_GetChannel(fired[i].fd) != src)
+            continue; // stale
 
         // 执行对应的回调函数
         if (fired[i].events & internal::eET_Read) {
@@ -279,14 +418,132 @@ bool EventLoop::_Loop(DurationMs timeout) { // 一个loop循环
         }
 
         if (fired[i].events & internal::eET_Error) {
-            ANANAS_ERR << "eET_Error for " << src->Identifier();
+            // also for MSG_ZEROCOPY completions, source decides if it is a real error
+            ANANAS_DBG << "eET_Error for " << src->Identifier();
             src->HandleErrorEvent();
         }
     }
 
+    dispatching_ = false;
+    graveyard_.clear();
+
     return ready >= 0;
 }
 
+void EventLoop::AddDirty(std::shared_ptr<Connection> conn) {
+    assert (InThisLoop());
+    dirty_.push_back(std::move(conn));
+}
+
+void EventLoop::_FlushDirty() {
+    if (dirty_.empty())
+        return;
+
+    // data sent by callbacks in flushing goes out directly
+    flushingDirty_ = true;
+    ANANAS_DEFER {
+        flushingDirty_ = false;
+    };
+
+    std::vector<std::shared_ptr<Connection> > dirty;
+    dirty.swap(dirty_);
+    for (auto& conn : dirty)
+        conn->_FlushBatch();
+
+    // keep capacity for next iteration
+    dirty.clear();
+    if (dirty_.empty())
+        dirty_.swap(dirty);
+}
+
+void EventLoop::_PostTask(std::function<void ()>&& func) {
+    Task* task = new Task;
+    task->func = std::move(func);
+    tasks_.Push(task);
+    postedTasks_.fetch_add(1, std::memory_order_relaxed);
+
+    // Must after Push: if _RunTasks has cleared the flag, it may miss this
+    // task, so notify it; otherwise _RunTasks will see this task.
+    if (!wakeupPending_.exchange(true, std::memory_order_acq_rel))
+        notifier_->Notify();    // 写一些东西使fd可读, 唤醒epoll_wait
+}
+
+void EventLoop::_RunTasks() {
+    // Must before Pop, see _PostTask
+    if (!wakeupPending_.exchange(false, std::memory_order_acq_rel))
+        return;
+
+    while (Task* task = tasks_.Pop()) {
+        std::unique_ptr<Task> guard(task);
+        task->func();
+    }
+}
+
+void EventLoop::SetBusyPoll(std::chrono::microseconds budget, bool sockBusyPoll) {
+    busyPollBudget_ = std::max(budget, std::chrono::microseconds(0));
+    sockBusyPoll_ = sockBusyPoll && busyPollBudget_.count() > 0;
+}
+
+int EventLoop::_BusyPoll(std::size_t maxEvent, int timeoutMs) {
+    if (timeoutMs == 0)
+        return poller_->Poll(maxEvent, 0);
+
+    // Don't spin beyond the poll timeout, timers must not be delayed
+    auto budget = busyPollBudget_;
+    if (timeoutMs > 0)
+        budget = std::min<std::chrono::microseconds>(budget, DurationMs(timeoutMs));
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + budget;
+    do {
+        const int ready = poller_->Poll(maxEvent, 0);
+        if (ready != 0) {
+            if (ready > 0)
+                busyPollHits_.store(busyPollHits_.load(std::memory_order_relaxed) + 1,
+                                    std::memory_order_relaxed);
+            return ready;
+        }
+    } while (std::chrono::steady_clock::now() < end);
+
+    busyPollSleeps_.store(busyPollSleeps_.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+
+    if (timeoutMs > 0) {
+        const auto spent = std::chrono::duration_cast<DurationMs>(std::chrono::steady_clock::now() - start);
+        timeoutMs = std::max(0, timeoutMs - static_cast<int>(spent.count()));
+    }
+
+    return poller_->Poll(maxEvent, timeoutMs);
+}
+
+void EventLoop::_UpdateLoad(std::chrono::steady_clock::duration busy,
+                            std::chrono::steady_clock::duration total) {
+    if (total.count() <= 0)
+        return;
+
+    busy = std::max(busy, std::chrono::steady_clock::duration::zero());
+    const auto sample = static_cast<unsigned int>(std::min<int64_t>(1000, busy * 1000 / total));
+
+    // EWMA, weight 1/8
+    const unsigned int old = load_.load(std::memory_order_relaxed);
+    load_.store((old * 7 + sample) / 8, std::memory_order_relaxed);
+}
+
+const std::size_t EventLoop::kScratchSize = 64 * 1024;
+
+char* EventLoop::ScratchBuffer() {
+    assert (InThisLoop());
+
+    if (!scratch_)
+        scratch_.reset(new char[kScratchSize]);
+
+    return scratch_.get();
+}
+
+void EventLoop::Wakeup() {
+    notifier_->Notify();
+}
+
 bool EventLoop::InThisLoop() const {
     return this == g_thisLoop;
 }
@@ -296,14 +553,18 @@ void EventLoop::ScheduleLater(std::chrono::milliseconds duration,
     if (InThisLoop()) {
         ScheduleAfterWithRepeat<1>(duration, std::move(f));
     } else {
-        Execute([=]() {
+        _PostTask([=]() {
             ScheduleAfterWithRepeat<1>(duration, std::move(f));
         });
     }
 }
 
 void EventLoop::Schedule(std::function<void()> f) {
-    Execute(std::move(f));
+    // Same as Execute, but nobody waits the result, no promise needed
+    if (InThisLoop())
+        f();
+    else
+        _PostTask(std::move(f));
 }
 
 } // namespace ananas
@@ -2,8 +2,10 @@
 #ifndef BERT_EVENTLOOP_H
 #define BERT_EVENTLOOP_H
 
-#include <map>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <vector>
 #include <sys/resource.h>
 
 #include "Poller.h"
@@ -11,6 +13,7 @@
 #include "Typedefs.h"
 #include "ananas/util/Timer.h"
 #include "ananas/util/Scheduler.h"
+#include "ananas/util/MpscQueue.h"
 #include "ananas/future/Future.h"
 
 namespace ananas {
@@ -19,15 +22,23 @@ struct SocketAddr;
 
 namespace internal {
 class Connector;
+class TimerChannel;
 }
 
+///@brief The IO multiplexer of EventLoop
+enum class PollerType {
+    ePT_Default,    // epoll on linux, kqueue on mac os
+    ePT_IoUring,    // io_uring on linux, fallback to epoll if kernel not support
+};
+
 ///@brief EventLoop class
 ///
 /// One thread should at most has one EventLoop object.
 class EventLoop : public Scheduler {
 public:
     ///@brief Constructor
-    EventLoop();
+    explicit
+    EventLoop(PollerType type = PollerType::ePT_Default);
     ~EventLoop();
 
     EventLoop(const EventLoop& ) = delete;  // 不可拷贝和移动
@@ -36,15 +47,19 @@ public:
     void operator= (EventLoop&& ) = delete;
 
     // listener
-    bool Listen(const SocketAddr& addr, NewTcpConnCallback cb); 
-    bool Listen(const char* ip, uint16_t hostPort, NewTcpConnCallback cb);
+    ///@param reusePort Listen with SO_REUSEPORT, connections are accepted into this loop
+    bool Listen(const SocketAddr& addr, NewTcpConnCallback cb, bool reusePort = false);
+    bool Listen(const char* ip, uint16_t hostPort, NewTcpConnCallback cb, bool reusePort = false);
+    ///@param reusePort Bind with SO_REUSEPORT, packets are received in this loop
     bool ListenUDP(const SocketAddr& listenAddr,
                    UDPMessageCallback mcb,
-                   UDPCreateCallback ccb);
+                   UDPCreateCallback ccb,
+                   bool reusePort = false);
     bool ListenUDP(const char* ip,
                    uint16_t hostPort,
                    UDPMessageCallback mcb,
-                   UDPCreateCallback ccb);
+                   UDPCreateCallback ccb,
+                   bool reusePort = false);
 
     // udp client
     bool CreateClientUDP(UDPMessageCallback mcb,
@@ -75,6 +90,16 @@ public:
     ///@brief Cancel timer
     bool Cancel(TimerId id);
 
+    ///@brief Use timing wheel or not, only valid when there is no timer
+    ///
+    /// Timing wheel has O(1) schedule and cancel, but 1ms precision.
+    bool SetTimerMode(TimerMode mode);
+
+    ///@brief Drive timers by timerfd, only valid before Run
+    ///
+    /// Timers get nanosecond resolution instead of millisecond, linux only.
+    bool SetHighResolutionTimer(bool enable);
+
     /// See `Timer::ScheduleAt`
     /// See [ScheduleAt](@ref Timer::ScheduleAt)
     template <typename F, typename... Args>
@@ -85,7 +110,7 @@ public:
     template <typename Duration, typename F, typename... Args>
     TimerId ScheduleAfter(const Duration& , F&& , Args&&...);
 
-    ///@brief Internal use for future
+    ///@brief Internal use for future, also cheap Execute without result
     ///
     /// thread-safe
     void ScheduleLater(std::chrono::milliseconds , std::function<void ()> ) override;
@@ -117,13 +142,100 @@ public:
     /// It's a infinite loop, until Application stopped
     void Run();
 
+    ///@brief Change the poller
+    ///
+    /// Only valid before any channel registered, that is, before Run
+    bool SetPollerType(PollerType type);
+    PollerType GetPollerType() const {
+        return pollerType_;
+    }
+
+    ///@brief Use edge triggered poller, only valid before Run
+    ///
+    /// Redundant poller modifications are skipped, see SkippedModifies
+    bool SetEdgeTriggered(bool et);
+    ///@brief How many poller modifications are skipped by interest cache
+    std::size_t SkippedModifies() const;
+
     bool Register(int events, std::shared_ptr<internal::Channel> src);  // 注册channel到poller
     bool Modify(int events, std::shared_ptr<internal::Channel> src);
     void Unregister(int events, std::shared_ptr<internal::Channel> src);
 
+    ///@brief Shared receive area of all connections in this loop
+    ///
+    /// Data is read here first, connection keeps only the unconsumed part.
+    /// Size is kScratchSize, allocated on first use.
+    char* ScratchBuffer();
+    static const std::size_t kScratchSize;
+
+    ///@brief Defer sends of all connections to the end of iteration
+    ///
+    /// Data sent by connections with batch send enabled, whether from events,
+    /// timers or tasks, is collected and written once after all of them run.
+    /// Good for fan-out like broadcast, fewer syscalls and packets.
+    void SetDeferredFlush(bool enable) {
+        deferredFlush_ = enable;
+    }
+    bool DeferredFlush() const {
+        return deferredFlush_;
+    }
+    ///@brief True when flushing dirty connections, sends go out at once
+    bool FlushingDirty() const {
+        return flushingDirty_;
+    }
+    ///@brief Connection has deferred data, internal use
+    void AddDirty(std::shared_ptr<Connection> conn);
+
+    ///@brief Max connections accepted by one listener in one wakeup
+    void SetAcceptBudget(std::size_t budget) {
+        acceptBudget_ = std::max<std::size_t>(1, budget);
+    }
+    std::size_t AcceptBudget() const {
+        return acceptBudget_;
+    }
+
+    ///@brief Spin on poller before blocking, for low latency
+    ///@param budget How long to spin in each iteration, zero to disable
+    ///@param sockBusyPoll Also set SO_BUSY_POLL with budget on accepted sockets
+    ///
+    /// Only use it if the loop thread can own a cpu core.
+    void SetBusyPoll(std::chrono::microseconds budget, bool sockBusyPoll = false);
+    std::chrono::microseconds BusyPollBudget() const {
+        return busyPollBudget_;
+    }
+    bool SockBusyPoll() const {
+        return sockBusyPoll_;
+    }
+    ///@brief How many times spinning got events
+    std::size_t BusyPollHits() const {
+        return busyPollHits_.load(std::memory_order_relaxed);
+    }
+    ///@brief How many times spinning got nothing and then blocked
+    std::size_t BusyPollSleeps() const {
+        return busyPollSleeps_.load(std::memory_order_relaxed);
+    }
+
+    ///@brief Wake up the loop if it's waiting for events
+    ///
+    /// thread-safe
+    void Wakeup();
+    ///@brief How many tasks are posted by Execute or Schedule
+    ///
+    /// thread-safe
+    std::size_t PostedTasks() const {
+        return postedTasks_.load(std::memory_order_relaxed);
+    }
+
+    ///@brief How busy the loop is, in permille of wall time, smoothed
+    ///
+    /// thread-safe
+    unsigned int Load() const {
+        return load_.load(std::memory_order_relaxed);
+    }
+
     ///@brief Connection size
     std::size_t Size() const {
-        return channelSet_.size();
+        return nChannels_.load(std::memory_order_relaxed);
     }
 
     ///@brief If the caller thread run this loop?
@@ -149,19 +261,70 @@ public:
     static void SetMaxOpenFd(rlim_t maxfdPlus1);
 
 private:
-    bool _Loop(DurationMs timeout);
+    bool _Loop(int timeoutMs);
+    void _UpdateLoad(std::chrono::steady_clock::duration busy,
+                     std::chrono::steady_clock::duration total);
+    int _PollTimeout();
+    int _BusyPoll(std::size_t maxEvent, int timeoutMs);
+
+    internal::Channel* _GetChannel(int fd) const {
+        if (fd < 0 || static_cast<std::size_t>(fd) >= channels_.size())
+            return nullptr;
+
+        return channels_[fd].get();
+    }
 
     std::unique_ptr<internal::Poller> poller_;  // eventloop与之对应的poller_
+    PollerType pollerType_ {PollerType::ePT_Default};
+    bool edgeTriggered_ {false};
+
+    std::size_t acceptBudget_ {64};
+    std::unique_ptr<char []> scratch_;
+
+    // see SetDeferredFlush
+    void _FlushDirty();
+    bool deferredFlush_ {false};
+    bool flushingDirty_ {false};
+    std::vector<std::shared_ptr<Connection> > dirty_;
+
+    // see Load
+    std::atomic<unsigned int> load_ {0};
+    std::chrono::steady_clock::duration idle_ {0}; // blocked in poll in last _Loop
+
+    std::chrono::microseconds busyPollBudget_ {0};
+    bool sockBusyPoll_ {false};
+    // only written by loop thread, can be read by others
+    std::atomic<std::size_t> busyPollHits_ {0};
+    std::atomic<std::size_t> busyPollSleeps_ {0};
 
     std::shared_ptr<internal::PipeChannel> notifier_;   // 这个是eventfd,用来唤醒reactor阻塞的epoll_wait
 
     internal::TimerManager timers_;
+    bool highResTimer_ {false};
+    std::shared_ptr<internal::TimerChannel> timerChannel_;
+
+    // channels_ must be destructed before timers_
+    std::vector<std::shared_ptr<internal::Channel> > channels_;    // channel集合, 下标是fd
+    std::atomic<std::size_t> nChannels_ {0};
+
+    // Channels unregistered while dispatching fired events, they are kept
+    // alive until the iteration ends, so their address can not be reused
+    // by a new channel of same fd in this iteration.
+    std::vector<std::shared_ptr<internal::Channel> > graveyard_;
+    bool dispatching_ {false};
 
-    // channelSet_ must be destructed before timers_
-    std::map<unsigned int, std::shared_ptr<internal::Channel> > channelSet_;    // channel集合, map fd->channel
+    // cross thread tasks, see Execute
+    struct Task : public MpscNode {
+        std::function<void ()> func;
+    };
 
-    std::mutex fctrMutex_;  // 互斥器
-    std::vector<std::function<void ()> > functors_;     // 要处理的函数任务
+    void _PostTask(std::function<void ()>&& func);
+    void _RunTasks();
+
+    MpscQueue<Task> tasks_;     // 要处理的函数任务
+    // only the first task since last _RunTasks wakes up loop
+    std::atomic<bool> wakeupPending_ {false};
+    std::atomic<std::size_t> postedTasks_ {0};
 
     int id_;
     static std::atomic<int> s_evId;
@@ -233,12 +396,7 @@ EventLoop::Execute(F&& f, Args&&... args) {
             }
         };
 
-        {
-            std::unique_lock<std::mutex> guard(fctrMutex_);
-            functors_.emplace_back(std::move(func));    // func加入要执行线程functors_列表
-        }
-
-        notifier_->Notify();    // 写一些东西使fd可读, 唤醒epoll_wait
+        _PostTask(std::move(func));    // func加入要执行线程的任务队列, 必要时唤醒epoll_wait
     }
 
     return future;
@@ -268,12 +426,7 @@ Future<void> EventLoop::Execute(F&& f, Args&&... args) {
             }
         };
 
-        {
-            std::unique_lock<std::mutex> guard(fctrMutex_);
-            functors_.emplace_back(std::move(func));
-        }
-
-        notifier_->Notify();
+        _PostTask(std::move(func));
     }
 
     return future;
@@ -0,0 +1,419 @@
+
+#ifdef __gnu_linux__
+
+#include "IoUring.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "AnanasDebug.h"
+
+namespace ananas {
+namespace internal {
+
+namespace Uring {
+int Setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int Enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void* arg, size_t argSize) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+uint32_t ToPollMask(int events) {
+    uint32_t mask = 0;
+    if (events & eET_Read)
+        mask |= POLLIN;
+    if (events & eET_Write)
+        mask |= POLLOUT;
+
+    return mask;
+}
+}
+
+const uint64_t IoUring::kIgnoredUserData = ~static_cast<uint64_t>(0);
+
+IoUring::IoUring() {
+    if (!_Setup(1024))
+        _Teardown();
+
+    ANANAS_DBG << "create io_uring: " << multiplexer_;
+}
+
+IoUring::~IoUring() {
+    ANANAS_DBG << "close io_uring:  " << multiplexer_;
+    _Teardown();
+}
+
+bool IoUring::_Setup(unsigned entries) {
+    io_uring_params params;
+    ::memset(&params, 0, sizeof params);
+
+    multiplexer_ = Uring::Setup(entries, &params);
+    if (multiplexer_ < 0) {
+        ANANAS_WRN << "io_uring_setup failed, errno " << errno;
+        return false;
+    }
+
+    // timeout of io_uring_enter depends on it, since linux 5.11
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        ANANAS_WRN << "io_uring has no IORING_FEAT_EXT_ARG";
+        return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, multiplexer_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        return false;
+    }
+
+    if (singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, multiplexer_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            return false;
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, multiplexer_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char* sq = static_cast<char*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqEntries_ = params.sq_entries;
+
+    char* cq = static_cast<char*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    return true;
+}
+
+void IoUring::_Teardown() {
+    if (sqes_)
+        ::munmap(sqes_, sqesSize_);
+    if (cqRing_ && cqRing_ != sqRing_)
+        ::munmap(cqRing_, cqRingSize_);
+    if (sqRing_)
+        ::munmap(sqRing_, sqRingSize_);
+
+    sqes_ = nullptr;
+    cqRing_ = sqRing_ = nullptr;
+
+    if (multiplexer_ != -1) {
+        ::close(multiplexer_);
+        multiplexer_ = -1;
+    }
+}
+
+bool IoUring::_SqFull() const {
+    return *sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_;
+}
+
+io_uring_sqe* IoUring::_GetSqe() {
+    // SQ is full, submit without waiting. If CQ overflowed, kernel refuses
+    // new sqes(EBUSY) until cqes are reaped, so stash them and retry.
+    for (int retry = 0; _SqFull(); ++ retry) {
+        if (retry > 0)
+            _StashCqes();
+
+        if (retry == 4 || _Submit(0, 0) < 0) {
+            ANANAS_ERR << "io_uring SQ is full";
+            return nullptr;
+        }
+    }
+
+    const unsigned tail = *sqTail_;
+    const unsigned index = tail & *sqMask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    ::memset(sqe, 0, sizeof *sqe);
+
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    ++ pendingSubmit_;
+
+    return sqe;
+}
+
+int IoUring::_Submit(unsigned minComplete, int timeoutMs) {
+    unsigned flags = 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+
+    if (minComplete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+        ::memset(&arg, 0, sizeof arg);
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+    } else if (pendingSubmit_ == 0) {
+        return 0;
+    }
+
+    int ret = Uring::Enter(multiplexer_, pendingSubmit_, minComplete, flags,
+                           flags ? &arg : nullptr, flags ? sizeof arg : 0);
+    if (ret >= 0) {
+        pendingSubmit_ -= std::min<unsigned>(pendingSubmit_, ret);
+        return ret;
+    }
+
+    switch (errno) {
+    case ETIME:
+    case EINTR:
+    case EBUSY: // CQ overflowed, reap first
+        return 0;
+
+    default:
+        ANANAS_ERR << "io_uring_enter failed, errno " << errno;
+        return -1;
+    }
+}
+
+void IoUring::_StashCqes() {
+    unsigned head = *cqHead_;
+    const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++ head)
+        backlog_.push_back(cqes_[head & *cqMask_]);
+
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+bool IoUring::_PrepPollAdd(int fd) {
+    io_uring_sqe* sqe = _GetSqe();
+    if (!sqe)
+        return false;
+
+    Interest& it = fds_[fd];
+    it.needArm = false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = Uring::ToPollMask(it.events);
+    sqe->len = multishot_ ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = _MakeUserData(fd, it.gen);
+    return true;
+}
+
+bool IoUring::_PrepPollRemove(int fd) {
+    io_uring_sqe* sqe = _GetSqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = _MakeUserData(fd, fds_[fd].gen);
+    sqe->user_data = kIgnoredUserData;
+    return true;
+}
+
+bool IoUring::Register(int fd, int events, void* userPtr) {
+    if (fd < 0 || !IsValid())
+        return false;
+
+    if (static_cast<std::size_t>(fd) >= fds_.size())
+        fds_.resize(fd + 1);
+
+    Interest& it = fds_[fd];
+    if (it.active)
+        return Modify(fd, events, userPtr);
+
+    it.userPtr = userPtr;
+    it.events = events;
+    it.active = true;
+    ++ it.gen;
+
+    if (!_PrepPollAdd(fd)) {
+        it.active = false;
+        it.userPtr = nullptr;
+        it.events = 0;
+        return false;
+    }
+
+    return true;
+}
+
+bool IoUring::Modify(int fd, int events, void* userPtr) {
+    if (events == 0)
+        return Unregister(fd, 0);
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= fds_.size() || !fds_[fd].active)
+        return Register(fd, events, userPtr);
+
+    Interest& it = fds_[fd];
+    it.userPtr = userPtr;
+    if (it.events == events) {
+        ++ skippedModifies_;
+        return true;
+    }
+
+    if (!_PrepPollRemove(fd))
+        return false; // nothing changed
+
+    it.events = events;
+    ++ it.gen;
+    if (!_PrepPollAdd(fd)) {
+        // old poll is being removed, fd is not polled any more
+        it.active = false;
+        it.userPtr = nullptr;
+        it.events = 0;
+        return false;
+    }
+
+    return true;
+}
+
+bool IoUring::Unregister(int fd, int ) { // poll of fd is removed for all events
+    if (fd < 0 || static_cast<std::size_t>(fd) >= fds_.size())
+        return false;
+
+    Interest& it = fds_[fd];
+    if (!it.active)
+        return false;
+
+    if (!_PrepPollRemove(fd))
+        ANANAS_ERR << "io_uring can not remove poll of fd " << fd;
+
+    // cqes still in flight will be dropped by generation check
+    it.active = false;
+    it.userPtr = nullptr;
+    it.events = 0;
+    ++ it.gen;
+
+    return true;
+}
+
+int IoUring::Poll(std::size_t maxEvent, int timeoutMs) {
+    if (maxEvent == 0 || !IsValid())
+        return 0;
+
+    // polls terminated when SQ was full
+    if (!rearm_.empty()) {
+        std::vector<int> fds;
+        fds.swap(rearm_);
+        for (int fd : fds) {
+            Interest& it = fds_[fd];
+            if (it.active && it.needArm && !_PrepPollAdd(fd))
+                rearm_.push_back(fd);
+        }
+    }
+
+    const bool hasCqe = !backlog_.empty() ||
+                        *cqHead_ != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    if (hasCqe || timeoutMs == 0) {
+        if (_Submit(0, 0) < 0)
+            return -1;
+    } else {
+        if (_Submit(1, timeoutMs) < 0)
+            return -1;
+    }
+
+    ++ pollSeq_;
+
+    // Re-arming below may stash new cqes to backlog_, they are for next Poll
+    _StashCqes();
+    handling_.clear();
+    handling_.swap(backlog_);
+
+    int nFired = 0;
+    for (const auto& cqe : handling_)
+        _HandleCqe(cqe, nFired);
+
+    return nFired;
+}
+
+void IoUring::_HandleCqe(const io_uring_cqe& cqe, int& nFired) {
+    if (cqe.user_data == kIgnoredUserData)
+        return;
+
+    const int fd = static_cast<int>(cqe.user_data & 0xFFFFFFFF);
+    const uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32);
+    if (fd < 0 || static_cast<std::size_t>(fd) >= fds_.size())
+        return;
+
+    Interest& it = fds_[fd];
+    if (!it.active || it.gen != gen)
+        return; // stale
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // poll is terminated, arm it again
+        if (cqe.res == -EINVAL && multishot_) {
+            ANANAS_WRN << "io_uring multishot poll not supported, use oneshot";
+            multishot_ = false;
+        }
+
+        ++ it.gen;
+        if (!_PrepPollAdd(fd) && !it.needArm) {
+            it.needArm = true;
+            rearm_.push_back(fd); // retry in next Poll
+        }
+    }
+
+    if (cqe.res == -ECANCELED || cqe.res == -EINVAL)
+        return;
+
+    int fired = 0;
+    if (cqe.res < 0) {
+        fired = eET_Error;
+    } else {
+        if (cqe.res & POLLIN)
+            fired |= eET_Read;
+        if (cqe.res & POLLOUT)
+            fired |= eET_Write;
+        if (cqe.res & (POLLERR | POLLHUP))
+            fired |= eET_Error;
+    }
+
+    if (fired == 0)
+        return;
+
+    auto& events = firedEvents_;
+    if (it.firedSeq == pollSeq_) {
+        events[it.firedIndex].events |= fired;
+        return;
+    }
+
+    if (static_cast<std::size_t>(nFired) >= events.size())
+        events.resize(2 * events.size() + 1);
+
+    it.firedSeq = pollSeq_;
+    it.firedIndex = nFired;
+
+    FiredEvent& ev = events[nFired ++];
+    ev.events = fired;
+    ev.fd = fd;
+    ev.userdata = it.userPtr;
+}
+
+} // namespace internal
+} // namespace ananas
+
+#endif
+
@@ -0,0 +1,115 @@
+
+#ifndef BERT_IOURING_H
+#define BERT_IOURING_H
+
+#ifdef __gnu_linux__
+
+#include <stdint.h>
+#include <vector>
+#include <linux/io_uring.h>
+#include "Poller.h"
+
+namespace ananas {
+namespace internal {
+
+///@brief Poller built on io_uring multishot poll.
+///
+/// Register/Modify/Unregister only fill submission entries, all of them
+/// are submitted together with the wait in Poll(), so one loop iteration
+/// costs exactly one io_uring_enter.
+/// Multishot poll is edge triggered, channels must drain until EAGAIN.
+class IoUring : public Poller {
+public:
+    IoUring();
+    ~IoUring();
+
+    IoUring(const IoUring& ) = delete;
+    void operator= (const IoUring& ) = delete;
+
+    ///@brief If false, kernel does not support it, use Epoller instead
+    bool IsValid() const {
+        return sqes_ != nullptr;
+    }
+
+    bool Register(int fd, int events, void* userPtr) override;
+    bool Modify(int fd, int events, void* userPtr) override;
+    bool Unregister(int fd, int events) override;
+
+    int Poll(std::size_t maxEvent, int timeoutMs) override;
+
+    // multishot poll is always edge triggered
+    bool SetEdgeTriggered(bool ) override {
+        return true;
+    }
+
+private:
+    struct Interest {
+        void* userPtr {nullptr};
+        int events {0};
+        uint32_t gen {0};
+        bool active {false};
+        bool needArm {false}; // in rearm_
+
+        // for merging cqes of same fd in one Poll
+        uint32_t firedSeq {0};
+        int firedIndex {0};
+    };
+
+    bool _Setup(unsigned entries);
+    void _Teardown();
+
+    // nullptr if SQ is still full after submit
+    io_uring_sqe* _GetSqe();
+    bool _SqFull() const;
+    int _Submit(unsigned minComplete, int timeoutMs);
+    // move cqes from CQ to backlog_, so kernel can flush overflowed cqes
+    void _StashCqes();
+    void _HandleCqe(const io_uring_cqe& cqe, int& nFired);
+
+    bool _PrepPollAdd(int fd);
+    bool _PrepPollRemove(int fd);
+
+    static uint64_t _MakeUserData(int fd, uint32_t gen) {
+        return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    std::vector<Interest> fds_;
+    bool multishot_ {true};
+    uint32_t pollSeq_ {0};
+    // fds whose poll terminated but can't be armed again because SQ is full
+    std::vector<int> rearm_;
+
+    // submission queue
+    unsigned* sqHead_ {nullptr};
+    unsigned* sqTail_ {nullptr};
+    unsigned* sqMask_ {nullptr};
+    unsigned* sqArray_ {nullptr};
+    unsigned sqEntries_ {0};
+    unsigned pendingSubmit_ {0};
+    io_uring_sqe* sqes_ {nullptr};
+
+    // completion queue
+    unsigned* cqHead_ {nullptr};
+    unsigned* cqTail_ {nullptr};
+    unsigned* cqMask_ {nullptr};
+    io_uring_cqe* cqes_ {nullptr};
+    // reaped from CQ but not handled yet, reused by every Poll
+    std::vector<io_uring_cqe> backlog_;
+    std::vector<io_uring_cqe> handling_;
+
+    void* sqRing_ {nullptr};
+    void* cqRing_ {nullptr};
+    std::size_t sqRingSize_ {0};
+    std::size_t cqRingSize_ {0};
+    std::size_t sqesSize_ {0};
+
+    static const uint64_t kIgnoredUserData;
+};
+
+} // namespace internal
+} // namespace ananas
+
+#endif // end #ifdef __gnu_linux__
+
+#endif
+
@@ -94,6 +94,7 @@ int Kqueue::Poll(std::size_t maxEvent, int timeoutMs) {
     for (int i = 0; i < nFired; ++ i) {
         FiredEvent& fired = events[i];
         fired.events   = 0;
+        fired.fd       = static_cast<int>(events_[i].ident);
         fired.userdata = events_[i].udata;
 
         if (events_[i].filter == EVFILT_READ)
@@ -1,6 +1,13 @@
+
+#include <errno.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <cassert>
 
+#if defined(__gnu_linux__)
+#include <sys/eventfd.h>
+#endif
+
 #include "Socket.h"
 #include "PipeChannel.h"
 
@@ -9,6 +16,11 @@ namespace ananas {
 namespace internal {
 
 PipeChannel::PipeChannel() {    // 也就创建了管道fd, 通信管道
+#if defined(__gnu_linux__)
+    // eventfd is enough for notify, one fd and 8 bytes counter
+    readFd_ = writeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert (readFd_ != kInvalid);
+#else
     int fd[2];
     int ret = ::pipe(fd);
     assert (ret == 0);
@@ -16,11 +28,13 @@ PipeChannel::PipeChannel() {    // 也就创建了管道fd, 通信管道
     writeFd_ = fd[1];
     SetNonBlock(readFd_, true);
     SetNonBlock(writeFd_, true);
+#endif
 }
 
 PipeChannel::~PipeChannel() {
     ::close(readFd_);
-    ::close(writeFd_);
+    if (writeFd_ != readFd_)
+        ::close(writeFd_);
 }
 
 int PipeChannel::Identifier() const {
@@ -28,9 +42,19 @@ int PipeChannel::Identifier() const {
 }
 
 bool PipeChannel::HandleReadEvent() {
-    char ch;
-    auto n = ::read(readFd_, &ch, sizeof ch);
-    return n == 1;
+    // Must clear before read: a Notify after here will write again,
+    // a Notify before here is visible to loop.
+    signalled_.exchange(false, std::memory_order_acq_rel);
+
+    // drain it, poller may be edge triggered
+    char buf[64];
+    while (true) {
+        auto n = ::read(readFd_, buf, sizeof buf);
+        if (n > 0)
+            continue;
+
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
 }
 
 bool PipeChannel::HandleWriteEvent() {
@@ -42,9 +66,19 @@ void PipeChannel::HandleErrorEvent() {
 }
 
 bool PipeChannel::Notify() {
+    // already signalled and not consumed by loop, no need to write
+    if (signalled_.exchange(true, std::memory_order_acq_rel))
+        return true;
+
+#if defined(__gnu_linux__)
+    uint64_t one = 1;
+    auto n = ::write(writeFd_, &one, sizeof one);
+    return n == sizeof one;
+#else
     char ch = 0;
     auto n = ::write(writeFd_, &ch, sizeof ch);
     return n == 1;
+#endif
 }
 
 } // end namespace internal
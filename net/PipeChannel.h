@@ -1,6 +1,7 @@
 #ifndef BERT_PIPECHANNEL_H
 #define BERT_PIPECHANNEL_H
 
+#include <atomic>
 #include "Poller.h"
 
 namespace ananas {
@@ -20,11 +21,17 @@ public:
     bool HandleWriteEvent() override;
     void HandleErrorEvent() override;
 
+    ///@brief Wake up the loop, thread-safe
+    ///
+    /// Only the first Notify since last HandleReadEvent will write fd.
+    /// On linux it's an eventfd, readFd_ is the same as writeFd_.
     bool Notify();
 
 private:
     int readFd_;
     int writeFd_;
+
+    std::atomic<bool> signalled_ {false};
 };
 
 } // end namespace internal
@@ -51,9 +51,10 @@ private:
 
 struct FiredEvent { // 过期事件
     int   events;
+    int   fd;
     void* userdata;
 
-    FiredEvent() : events(0), userdata(nullptr) {
+    FiredEvent() : events(0), fd(-1), userdata(nullptr) {
     }
 };
 
@@ -75,9 +76,22 @@ class Poller {  // 负责poll连接
         return firedEvents_;
     }
 
+    ///@brief Edge triggered mode, must be set before any fd registered.
+    ///
+    /// Channels must drain their fd until EAGAIN in this mode.
+    virtual bool SetEdgeTriggered(bool et) {
+        return !et;
+    }
+
+    ///@brief How many Modify are skipped because interest not changed
+    std::size_t SkippedModifies() const {
+        return skippedModifies_;
+    }
+
  protected:
     int multiplexer_;
     std::vector<FiredEvent> firedEvents_;   // 活跃的事件列表
+    std::size_t skippedModifies_ {0};
 };
 
 } // namespace internal
@@ -5,6 +5,9 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#if defined(__gnu_linux__)
+#include <linux/filter.h>
+#endif
 
 #include "Socket.h"
 
@@ -72,6 +75,113 @@ void SetReuseAddr(int sock) {
     ::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
 }
 
+void SetReusePort(int sock) {
+    int reuse = 1;
+    ::setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse));
+}
+
+bool SetBusyPoll(int sock, int usec) {
+#if defined(SO_BUSY_POLL)
+    return ::setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (const char*)&usec, sizeof(usec)) == 0;
+#else
+    (void)sock;
+    (void)usec;
+    return false;
+#endif
+}
+
+bool SetZeroCopy(int sock) {
+#if defined(SO_ZEROCOPY)
+    int on = 1;
+    return ::setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, (const char*)&on, sizeof(on)) == 0;
+#else
+    (void)sock;
+    return false;
+#endif
+}
+
+int GetIncomingCpu(int sock) {
+#if defined(SO_INCOMING_CPU)
+    int cpu = -1;
+    socklen_t len = sizeof cpu;
+    if (::getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+        return -1;
+
+    return cpu;
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+#if defined(__gnu_linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+static bool AttachReusePortFilter(int sock, std::vector<sock_filter>& code) {
+    sock_fprog prog;
+    prog.len = static_cast<unsigned short>(code.size());
+    prog.filter = code.data();
+
+    return ::setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == 0;
+}
+#endif
+
+bool AttachReusePortCpu(int sock, const std::vector<int>& indexOfCpu, std::size_t count) {
+#if defined(__gnu_linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (count == 0)
+        return false;
+
+    // A = cpu; if (A == c) return index; ... return A % count;
+    std::vector<sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+    for (std::size_t cpu = 0; cpu < indexOfCpu.size(); ++ cpu) {
+        if (indexOfCpu[cpu] < 0)
+            continue;
+
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpu), 0, 1));
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(indexOfCpu[cpu])));
+    }
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(count)));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+    // classic BPF limit
+    if (code.size() > BPF_MAXINSNS)
+        return false;
+
+    return AttachReusePortFilter(sock, code);
+#else
+    (void)sock;
+    (void)indexOfCpu;
+    (void)count;
+    return false;
+#endif
+}
+
+bool AttachReusePortPeerHash(int sock, std::size_t count) {
+#if defined(__gnu_linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (count == 0)
+        return false;
+
+    // skb data is past udp header, load ip saddr from network header
+    std::vector<sock_filter> code = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 12)),
+        // fold high bytes, A ^= A >> 16; A ^= A >> 8;
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 8),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(count)),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    return AttachReusePortFilter(sock, code);
+#else
+    (void)sock;
+    (void)count;
+    return false;
+#endif
+}
+
 bool GetLocalAddr(int sock, SocketAddr& addr) {
     sockaddr_in localAddr;
     socklen_t   len = sizeof(localAddr);
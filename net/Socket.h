@@ -8,6 +8,7 @@
 #include <string>
 #include <memory>
 #include <functional>
+#include <vector>
 
 namespace ananas {
 
@@ -144,6 +145,23 @@ void SetNodelay(int sock, bool enable = true);
 void SetSndBuf(int sock, socklen_t size = 64 * 1024);
 void SetRcvBuf(int sock, socklen_t size = 64 * 1024);
 void SetReuseAddr(int sock);
+void SetReusePort(int sock);
+///@brief Set SO_BUSY_POLL, linux only
+bool SetBusyPoll(int sock, int usec);
+///@brief Set SO_ZEROCOPY, linux only
+bool SetZeroCopy(int sock);
+///@brief Get SO_INCOMING_CPU, the cpu handled packets of sock, -1 if unknown
+int GetIncomingCpu(int sock);
+///@brief Steer packets of sock's SO_REUSEPORT group by the cpu received them, linux only
+///
+/// Socket index in group is the order of bind.
+///@param indexOfCpu Socket index for each cpu, -1 or absent means cpu % count
+///@param count Sockets in group
+bool AttachReusePortCpu(int sock, const std::vector<int>& indexOfCpu, std::size_t count);
+///@brief Steer packets of sock's SO_REUSEPORT group by hash of peer ip, linux only
+///
+/// Same peer ip always goes to same socket, IPv4 only.
+bool AttachReusePortPeerHash(int sock, std::size_t count);
 
 bool GetLocalAddr(int sock, SocketAddr& );  // 获得本地ip地址
 bool GetPeerAddr(int sock, SocketAddr& );   // 获得对方(socket连接方)的ip地址
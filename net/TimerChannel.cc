@@ -0,0 +1,86 @@
+
+#ifdef __gnu_linux__
+
+#include <cassert>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "TimerChannel.h"
+#include "AnanasDebug.h"
+
+namespace ananas {
+
+namespace internal {
+
+TimerChannel::TimerChannel() :
+    armed_(TimePoint::max()) {
+    // steady_clock is CLOCK_MONOTONIC on linux
+    fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd_ == -1)
+        ANANAS_WRN << "timerfd_create failed, errno " << errno;
+}
+
+TimerChannel::~TimerChannel() {
+    if (fd_ != -1)
+        ::close(fd_);
+}
+
+bool TimerChannel::Arm(const TimePoint& deadline) {
+    if (deadline == armed_)
+        return true;
+
+    struct itimerspec spec;
+    ::memset(&spec, 0, sizeof spec);
+
+    // all zero disarms the timer
+    if (deadline != TimePoint::max()) {
+        using namespace std::chrono;
+
+        auto ns = duration_cast<nanoseconds>(deadline.time_since_epoch()).count();
+        if (ns <= 0)
+            ns = 1;
+
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+    }
+
+    if (::timerfd_settime(fd_, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+        ANANAS_ERR << "timerfd_settime failed, errno " << errno;
+        return false;
+    }
+
+    armed_ = deadline;
+    return true;
+}
+
+int TimerChannel::Identifier() const {
+    return fd_;
+}
+
+bool TimerChannel::HandleReadEvent() {
+    // the timer is expired, timers will be updated by EventLoop
+    uint64_t expirations = 0;
+    auto n = ::read(fd_, &expirations, sizeof expirations);
+    if (n == sizeof expirations)
+        armed_ = TimePoint::max();
+
+    return n == sizeof expirations || (n == -1 && errno == EAGAIN);
+}
+
+bool TimerChannel::HandleWriteEvent() {
+    assert (false);
+    return false;
+}
+
+void TimerChannel::HandleErrorEvent() {
+}
+
+} // end namespace internal
+
+} // end namespace ananas
+
+#endif
+
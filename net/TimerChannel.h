@@ -0,0 +1,51 @@
+#ifndef BERT_TIMERCHANNEL_H
+#define BERT_TIMERCHANNEL_H
+
+#ifdef __gnu_linux__
+
+#include "Poller.h"
+#include "ananas/util/Timer.h"
+
+namespace ananas {
+
+namespace internal {
+
+///@brief timerfd armed to the nearest timer of EventLoop
+///
+/// With it, the poller can wait forever and timers get nanosecond
+/// resolution instead of the millisecond timeout of poll.
+class TimerChannel : public internal::Channel {
+public:
+    TimerChannel();
+    ~TimerChannel();
+
+    TimerChannel(const TimerChannel& ) = delete;
+    void operator= (const TimerChannel& ) = delete;
+
+    bool IsValid() const {
+        return fd_ != -1;
+    }
+
+    ///@brief Arm timer at absolute time, TimePoint::max() to disarm
+    ///
+    /// Do nothing if deadline is not changed.
+    bool Arm(const TimePoint& deadline);
+
+    int Identifier() const override;
+    bool HandleReadEvent() override;
+    bool HandleWriteEvent() override;
+    void HandleErrorEvent() override;
+
+private:
+    int fd_;
+    TimePoint armed_;
+};
+
+} // end namespace internal
+
+} // end namespace ananas
+
+#endif // end #ifdef __gnu_linux__
+
+#endif
+
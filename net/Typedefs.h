@@ -6,6 +6,7 @@
 namespace ananas {
 
 struct SocketAddr;
+struct Datagram;
 class Connection;
 class DatagramSocket;
 class EventLoop;
@@ -14,10 +15,13 @@ using NewTcpConnCallback = std::function<void (Connection* )>;  // Tcp连接回
 using TcpConnFailCallback = std::function<void (EventLoop*, const SocketAddr& peer)>;
 using TcpMessageCallback = std::function<size_t (Connection*, const char* data, size_t len)>;   // 信息回调
 using TcpWriteCompleteCallback = std::function<void (Connection* )>;
+using TcpHighWaterCallback = std::function<void (Connection*, std::size_t pendingBytes)>;
+using TcpLowWaterCallback = std::function<void (Connection* )>;
 using BindCallback = std::function<void (bool succ, const SocketAddr& )>;
 
 using UDPMessageCallback = std::function<void (DatagramSocket*, const char* data, size_t len)>;
 using UDPCreateCallback = std::function<void (DatagramSocket* )>;
+using UDPBatchMessageCallback = std::function<void (DatagramSocket*, const Datagram* msgs, size_t count)>;
 }
 
 #endif
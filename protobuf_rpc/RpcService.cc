@@ -257,10 +257,10 @@ void ServerChannel::_OnServDone(std::weak_ptr<ananas::Connection> wconn,
     // may be called from other thread, so use SafeSend
     if (encoder_.f2bEncoder_) {
         Buffer bytes = encoder_.f2bEncoder_(frame);
-        conn->SafeSend(bytes.ReadAddr(), bytes.ReadableSize());
+        conn->SafeSend(std::move(bytes));
     } else {
-        const auto& bytes = rsp->serialized_response();
-        conn->SafeSend(bytes);
+        auto bytes = rsp->mutable_serialized_response();
+        conn->SafeSend(IOBuf(std::move(*bytes)));
     }
 }
 
@@ -278,7 +278,7 @@ void ServerChannel::_OnError(const std::exception& err, int code) {
 
     if (encoder_.f2bEncoder_) {
         Buffer bytes = encoder_.f2bEncoder_(frame);
-        conn_->SendPacket(bytes);
+        conn_->SendPacket(std::move(bytes));
     } else {
         const auto& bytes = rsp->serialized_response();
         conn_->SendPacket(bytes);
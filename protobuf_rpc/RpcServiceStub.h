@@ -242,7 +242,7 @@ Future<Try<RSP>> ClientChannel::_Invoke(const StringView& method,
 
     // encode and send request
     Buffer bytes = this->_MessageToBytesEncoder(std::move(methodStr), *request);
-    if (!sc->SendPacket(bytes)) {
+    if (!sc->SendPacket(std::move(bytes))) {
         using namespace std;
         string err("SendPacket failed: method [" +
                     method.ToString() +
@@ -82,7 +82,7 @@ bool OpenSSLContext::SendData(const char* data, size_t len) {
         DBG(internal::g_debug) << "SSL_write send bytes " << buf.ReadableSize() << ", and buffer has " << sendBuffer_.ReadableSize();
 
         auto c = (ananas::Connection*)SSL_get_ex_data(ssl_, 0);
-        return c->SendPacket(buf.ReadAddr(), buf.ReadableSize());
+        return c->SendPacket(std::move(buf));
     }
 
     DBG(internal::g_debug) << "no data send";
@@ -135,7 +135,7 @@ size_t OpenSSLContext::ProcessHandshake(std::shared_ptr<OpenSSLContext> open, Co
 
     // send the encrypt data from write buffer
     Buffer toSend = GetMemData(SSL_get_wbio(ssl));
-    c->SendPacket(toSend.ReadAddr(), toSend.ReadableSize());
+    c->SendPacket(std::move(toSend));
 
     return len;
 }
@@ -200,7 +200,7 @@ size_t OpenSSLContext::ProcessData(std::shared_ptr<OpenSSLContext> open, Connect
         Buffer data = GetMemData(SSL_get_wbio(ssl));
         if (!data.IsEmpty()) {
             DBG(internal::g_debug) << "SSL_read status " << SSL_get_error(ssl, bytes) << ", but has to send data bytes " << data.ReadableSize();
-            c->SendPacket(data.ReadAddr(), data.ReadableSize());
+            c->SendPacket(std::move(data));
         }
     }
 
@@ -248,7 +248,7 @@ bool OpenSSLContext::DoHandleShake() {
     Buffer buf = OpenSSLContext::GetMemData(SSL_get_wbio(ssl_));
     if (!buf.IsEmpty()) {
         DBG(internal::g_debug) << "SSL_renegotiate send bytes " << buf.ReadableSize();
-        c->SendPacket(buf.ReadAddr(), buf.ReadableSize());
+        c->SendPacket(std::move(buf));
     }
 
     return true;
@@ -317,7 +317,7 @@ void OnNewSSLConnection(const std::string& ctxName, int verifyMode, bool incomin
 
     // send the encrypt data from write buffer
     Buffer data = OpenSSLContext::GetMemData(SSL_get_wbio(ssl));
-    c->SendPacket(data.ReadAddr(), data.ReadableSize());
+    c->SendPacket(std::move(data));
 
     // !!!  test ssl_write when renegotiate !!!
 #ifdef TEST_SSL_RENEGO
@@ -0,0 +1,238 @@
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "gtest/gtest.h"
+#include "net/Application.h"
+#include "net/Connection.h"
+#include "net/DatagramSocket.h"
+#include "net/EventLoop.h"
+#include "TestUtil.h"
+
+using ananas::Application;
+using ananas::Connection;
+using ananas::DatagramSocket;
+using ananas::EventLoop;
+using ananas::SocketAddr;
+using ananas::UdpSteering;
+using ananas::test::RunApplication;
+using ananas::test::RunInProcess;
+
+namespace {
+
+// a loopback port nobody uses now
+uint16_t FreePort(int type) {
+    int sock = ::socket(AF_INET, type, 0);
+    sockaddr_in addr;
+    ::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    if (::bind(sock, (sockaddr*)&addr, sizeof addr) != 0 ||
+        ::getsockname(sock, (sockaddr*)&addr, &len) != 0) {
+        ::close(sock);
+        return 0;
+    }
+
+    ::close(sock);
+    return ntohs(addr.sin_port);
+}
+
+// one packet from each of count client sockets
+void SendFromClients(const SocketAddr& dst, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++ i) {
+        int client = ::socket(AF_INET, SOCK_DGRAM, 0);
+        EXPECT_EQ(::sendto(client, "ping", 4, 0, (const sockaddr*)&dst.GetAddr(), sizeof dst.GetAddr()), 4);
+        ::close(client);
+    }
+}
+
+// Packets from many ports of 127.0.0.1, received by worker loops
+void TestUdpReusePort(UdpSteering steering) {
+    RunInProcess([steering]() {
+        auto& app = Application::Instance();
+        app.SetNumOfWorker(2);
+        app.SetUdpReusePort(true, steering);
+
+        const uint16_t port = FreePort(SOCK_DGRAM);
+        ASSERT_NE(port, 0);
+
+        std::mutex mutex;
+        std::set<EventLoop*> created;
+        std::set<EventLoop*> receivers;
+        std::atomic<std::size_t> received {0};
+        const std::size_t kClients = 32;
+
+        auto ccb = [&](DatagramSocket* ) {
+            std::unique_lock<std::mutex> guard(mutex);
+            created.insert(EventLoop::Self());
+        };
+        auto mcb = [&](DatagramSocket* , const char* data, size_t len) {
+            EXPECT_EQ(std::string(data, len), "ping");
+            {
+                std::unique_lock<std::mutex> guard(mutex);
+                receivers.insert(EventLoop::Self());
+            }
+            if (++ received == kClients)
+                app.Exit();
+        };
+
+        int binds = 0;
+        auto bfcb = [&](bool succ, const SocketAddr& addr) {
+            ++ binds;
+            EXPECT_TRUE(succ);
+            if (succ)
+                SendFromClients(addr, kClients);
+            else
+                app.Exit();
+        };
+
+        app.ListenUDP("127.0.0.1", port, mcb, ccb, bfcb);
+        RunApplication(std::chrono::seconds(5));
+
+        EXPECT_EQ(binds, 1);
+        EXPECT_EQ(received.load(), kClients);
+        // one socket per worker, nothing on base loop
+        EXPECT_EQ(created.size(), 2U);
+        EXPECT_EQ(created.count(app.BaseLoop()), 0U);
+        EXPECT_EQ(receivers.count(app.BaseLoop()), 0U);
+        for (auto loop : receivers)
+            EXPECT_EQ(created.count(loop), 1U);
+
+        // all from 127.0.0.1, they go to same worker
+        if (steering == UdpSteering::eUS_HashPeer)
+            EXPECT_EQ(receivers.size(), 1U);
+    });
+}
+
+} // end namespace
+
+TEST(application, reuse_port_accepts_on_workers) {
+    RunInProcess([]() {
+        auto& app = Application::Instance();
+        app.SetNumOfWorker(2);
+        app.SetReusePort(true);
+
+        const uint16_t port = FreePort(SOCK_STREAM);
+        ASSERT_NE(port, 0);
+
+        const std::size_t kClients = 16;
+        std::mutex mutex;
+        std::vector<EventLoop*> acceptors;
+        std::vector<int> clients;
+
+        auto cb = [&](Connection* ) {
+            std::unique_lock<std::mutex> guard(mutex);
+            acceptors.push_back(EventLoop::Self());
+            if (acceptors.size() == kClients)
+                app.Exit();
+        };
+
+        int binds = 0;
+        auto bfcb = [&](bool succ, const SocketAddr& addr) {
+            ++ binds;
+            EXPECT_TRUE(succ);
+            if (!succ) {
+                app.Exit();
+                return;
+            }
+
+            for (std::size_t i = 0; i < kClients; ++ i) {
+                int client = ::socket(AF_INET, SOCK_STREAM, 0);
+                EXPECT_EQ(::connect(client, (const sockaddr*)&addr.GetAddr(), sizeof addr.GetAddr()), 0);
+                clients.push_back(client);
+            }
+        };
+
+        // deferred until workers started
+        app.Listen("127.0.0.1", port, cb, bfcb);
+        RunApplication(std::chrono::seconds(5));
+
+        EXPECT_EQ(binds, 1);
+        ASSERT_EQ(acceptors.size(), kClients);
+        for (auto loop : acceptors) {
+            EXPECT_NE(loop, nullptr);
+            EXPECT_NE(loop, app.BaseLoop());
+        }
+
+        for (int client : clients)
+            ::close(client);
+    });
+}
+
+TEST(application, udp_reuse_port_workers_share_port) {
+    TestUdpReusePort(UdpSteering::eUS_Kernel);
+}
+
+#if defined(__gnu_linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+TEST(application, udp_reuse_port_hash_peer) {
+    TestUdpReusePort(UdpSteering::eUS_HashPeer);
+}
+#endif
+
+// Second worker can't create its socket, the first one is closed,
+// bind callback is called once with false.
+TEST(application, udp_reuse_port_bind_failure) {
+    RunInProcess([]() {
+        auto& app = Application::Instance();
+        app.SetNumOfWorker(2);
+        app.SetUdpReusePort(true);
+
+        const uint16_t port = FreePort(SOCK_DGRAM);
+        ASSERT_NE(port, 0);
+
+        rlimit old;
+        ASSERT_EQ(::getrlimit(RLIMIT_NOFILE, &old), 0);
+
+        std::atomic<int> first {-1};
+        std::atomic<int> created {0};
+        auto ccb = [&](DatagramSocket* s) {
+            ++ created;
+            first = s->Identifier();
+
+            // no more fd for the next worker
+            const int lowest = ::dup(0);
+            ::close(lowest);
+            rlimit limit = old;
+            limit.rlim_cur = static_cast<rlim_t>(lowest);
+            EXPECT_EQ(::setrlimit(RLIMIT_NOFILE, &limit), 0);
+        };
+
+        int binds = 0;
+        auto bfcb = [&](bool succ, const SocketAddr& ) {
+            ++ binds;
+            EXPECT_FALSE(succ);
+            EXPECT_EQ(::setrlimit(RLIMIT_NOFILE, &old), 0);
+
+            // let the first worker close its socket, and wait for another bfcb
+            app.BaseLoop()->ScheduleAfter(std::chrono::milliseconds(100), [&]() {
+                ASSERT_NE(first.load(), -1);
+                EXPECT_EQ(::fcntl(first.load(), F_GETFD), -1);
+
+                // port is free again
+                int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+                SocketAddr addr("127.0.0.1", port);
+                EXPECT_EQ(::bind(sock, (const sockaddr*)&addr.GetAddr(), sizeof addr.GetAddr()), 0);
+                ::close(sock);
+
+                app.Exit();
+            });
+        };
+
+        app.ListenUDP("127.0.0.1", port,
+                      [](DatagramSocket* , const char* , size_t ) { },
+                      ccb, bfcb);
+        RunApplication(std::chrono::seconds(5));
+
+        EXPECT_EQ(binds, 1);
+        EXPECT_EQ(created.load(), 1);
+    });
+}
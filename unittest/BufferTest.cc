@@ -107,6 +107,54 @@ TEST(buffer, push_pop) {
     buf.Shrink();
     EXPECT_EQ(buf.Capacity(), 1);
 }
+TEST(buffer, pool) {
+    BufferPool::Trim();
+    const auto before = BufferPool::ThreadStats();
+
+    std::size_t size = 300;
+    char* block = BufferPool::Allocate(size);
+    EXPECT_EQ(size, 512);
+    BufferPool::Deallocate(block, size);
+
+    size = 400;
+    EXPECT_EQ(BufferPool::Allocate(size), block); // reuse
+    BufferPool::Deallocate(block, size);
+
+    size = BufferPool::kMaxClass + 1;
+    block = BufferPool::Allocate(size);
+    EXPECT_EQ(size, BufferPool::kMaxClass + 1); // too big, not pooled
+    BufferPool::Deallocate(block, size);
+
+    const auto& after = BufferPool::ThreadStats();
+    EXPECT_EQ(after.allocs - before.allocs, 3);
+    EXPECT_EQ(after.hits - before.hits, 1);
+    EXPECT_EQ(after.frees - before.frees, 3);
+    EXPECT_EQ(after.cachedBytes, 512);
+}
+
+TEST(buffer, pool_reuse) {
+    {
+        Buffer buf;
+        buf.PushData("hello", 5);
+    }
+
+    const auto hits = BufferPool::ThreadStats().hits;
+    Buffer buf;
+    buf.PushData("world", 5);
+    EXPECT_EQ(BufferPool::ThreadStats().hits, hits + 1);
+    EXPECT_EQ(buf.Capacity(), Buffer::kDefaultSize);
+
+    // block is bigger than capacity, grow without reallocation
+    buf.Shrink();
+    EXPECT_EQ(buf.Capacity(), 8);
+    const char* addr = buf.ReadAddr();
+    buf.AssureSpace(200);
+    EXPECT_EQ(buf.ReadAddr(), addr);
+
+    Buffer moved(std::move(buf));
+    EXPECT_EQ(buf.Capacity(), 0);
+    EXPECT_EQ(moved.ReadableSize(), 5);
+}
 
 
 int main(int argc, char **argv) {
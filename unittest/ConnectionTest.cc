@@ -0,0 +1,560 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "gtest/gtest.h"
+#include "net/Connection.h"
+#include "net/EventLoop.h"
+#include "TestUtil.h"
+
+using ananas::Application;
+using ananas::Connection;
+using ananas::EventLoop;
+using ananas::IOBuf;
+using ananas::test::RunApplication;
+using ananas::test::RunInProcess;
+using ananas::test::RunInThread;
+
+namespace {
+
+// connected loopback pair, server side is non-blocking
+bool MakeTcpPair(int& server, int& client, socklen_t clientRcvBuf = 1024 * 1024) {
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    ::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    if (::bind(listener, (sockaddr*)&addr, sizeof addr) != 0 ||
+        ::listen(listener, 1) != 0 ||
+        ::getsockname(listener, (sockaddr*)&addr, &len) != 0) {
+        ::close(listener);
+        return false;
+    }
+
+    client = ::socket(AF_INET, SOCK_STREAM, 0);
+    ananas::SetRcvBuf(client, clientRcvBuf);
+    if (::connect(client, (sockaddr*)&addr, sizeof addr) != 0) {
+        ::close(listener);
+        return false;
+    }
+
+    server = ::accept(listener, nullptr, nullptr);
+    ::close(listener);
+    if (server < 0)
+        return false;
+
+    // big enough for whole test data, so no write event is needed
+    ananas::SetSndBuf(server, 1024 * 1024);
+    ananas::SetNonBlock(server);
+    return true;
+}
+
+std::string ReadExactly(int sock, std::size_t len) {
+    std::string data;
+    char buf[16 * 1024];
+    while (data.size() < len) {
+        ssize_t n = ::recv(sock, buf, std::min(sizeof buf, len - data.size()), 0);
+        if (n <= 0)
+            break;
+        data.append(buf, static_cast<std::size_t>(n));
+    }
+
+    return data;
+}
+
+// unix stream pair, server side is non-blocking
+bool MakeUnixPair(int& server, int& client) {
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return false;
+
+    server = sv[0];
+    client = sv[1];
+    ananas::SetNonBlock(server);
+    return true;
+}
+
+// what peer can read now
+std::string ReadAvailable(int sock) {
+    std::string data;
+    char buf[16 * 1024];
+    ssize_t n;
+    while ((n = ::recv(sock, buf, sizeof buf, MSG_DONTWAIT)) > 0)
+        data.append(buf, static_cast<std::size_t>(n));
+
+    return data;
+}
+
+// unlinked temp file filled with content
+int MakeTempFile(const std::string& content) {
+    char path[] = "/tmp/ananas_connXXXXXX";
+    int fd = ::mkstemp(path);
+    if (fd == -1)
+        return -1;
+
+    ::unlink(path);
+    if (::write(fd, content.data(), content.size()) != static_cast<ssize_t>(content.size())) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+std::string MakeContent(std::size_t len) {
+    std::string content(len, '\0');
+    for (std::size_t i = 0; i < len; ++ i)
+        content[i] = static_cast<char>('a' + i % 23);
+
+    return content;
+}
+
+} // end namespace
+
+#if defined(__gnu_linux__) && defined(SO_ZEROCOPY)
+TEST(connection, zero_copy_reaped_on_loopback) {
+    RunInThread([]() {
+        EventLoop loop;
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client));
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        const std::string data(64 * 1024, 'z');
+        ASSERT_TRUE(conn->SendPacketZeroCopy(IOBuf(data.data(), data.size())));
+        EXPECT_GT(conn->ZeroCopyPending(), 0U);
+        EXPECT_EQ(ReadExactly(client, data.size()), data);
+
+        // completion is on error queue
+        pollfd pfd {server, 0, 0};
+        ASSERT_EQ(::poll(&pfd, 1, 1000), 1);
+        EXPECT_TRUE(pfd.revents & POLLERR);
+
+        conn->HandleErrorEvent();
+        EXPECT_EQ(conn->ZeroCopyPending(), 0U);
+
+        // loopback copies data, zero copy is turned off
+        ASSERT_TRUE(conn->SendPacketZeroCopy(IOBuf(data.data(), data.size())));
+        EXPECT_EQ(conn->ZeroCopyPending(), 0U);
+        EXPECT_EQ(ReadExactly(client, data.size()), data);
+
+        ::close(client);
+    });
+}
+
+TEST(connection, zero_copy_error_not_swallowed) {
+    RunInThread([]() {
+        EventLoop loop;
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client));
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        bool disconnected = false;
+        conn->SetOnDisconnect([&disconnected](Connection* ) {
+            disconnected = true;
+        });
+
+        const std::string data(64 * 1024, 'z');
+        ASSERT_TRUE(conn->SendPacketZeroCopy(IOBuf(data.data(), data.size())));
+        ASSERT_GT(conn->ZeroCopyPending(), 0U);
+
+        // peer resets without reading, completion and ECONNRESET come together
+        linger lg {1, 0};
+        ::setsockopt(client, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+        ::close(client);
+
+        pollfd pfd {server, 0, 0};
+        ASSERT_EQ(::poll(&pfd, 1, 1000), 1);
+
+        conn->HandleErrorEvent();
+        EXPECT_EQ(conn->ZeroCopyPending(), 0U);
+        EXPECT_TRUE(disconnected);
+    });
+}
+
+TEST(connection, zero_copy_keeps_socket_until_completion) {
+    RunInThread([]() {
+        EventLoop loop;
+        // peer's window is small, data not acked stays in our send queue
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client, 4096));
+
+        const std::string data(256 * 1024, 'z');
+        {
+            auto conn = std::make_shared<Connection>(&loop);
+            ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+
+            ASSERT_TRUE(conn->SendPacketZeroCopy(IOBuf(data.data(), data.size())));
+            ASSERT_GT(conn->ZeroCopyPending(), 0U);
+        }
+
+        // data is not read by peer, socket is kept by loop
+        EXPECT_NE(::fcntl(server, F_GETFD), -1);
+        EXPECT_EQ(ReadExactly(client, data.size()), data);
+        ::close(client);
+    });
+}
+
+// Loop is destroyed before completions arrive, lingering socket is closed
+TEST(connection, zero_copy_linger_closed_with_loop) {
+    RunInThread([]() {
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client, 4096));
+
+        const std::string data(256 * 1024, 'z');
+        {
+            EventLoop loop;
+            auto conn = std::make_shared<Connection>(&loop);
+            ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+
+            ASSERT_TRUE(conn->SendPacketZeroCopy(IOBuf(data.data(), data.size())));
+            ASSERT_GT(conn->ZeroCopyPending(), 0U);
+
+            conn.reset();
+            EXPECT_NE(::fcntl(server, F_GETFD), -1);
+        }
+
+        EXPECT_EQ(::fcntl(server, F_GETFD), -1);
+        ::close(client);
+    });
+}
+
+#endif
+
+// With deferred flush, data sent out of read event waits for end of loop
+// iteration, close right after send must not lose it.
+TEST(connection, deferred_send_then_close) {
+    RunInThread([]() {
+        EventLoop loop;
+        loop.SetDeferredFlush(true);
+
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client));
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        const std::string rsp("response");
+        ASSERT_TRUE(conn->SendPacket(rsp.data(), rsp.size()));
+        conn->ActiveClose();
+
+        // loop would call it: send the data, then close
+        EXPECT_FALSE(conn->HandleWriteEvent());
+        EXPECT_EQ(ReadExactly(client, rsp.size()), rsp);
+        conn->HandleErrorEvent();
+        ::close(client);
+    });
+}
+
+TEST(connection, deferred_send_then_shutdown) {
+    RunInThread([]() {
+        EventLoop loop;
+        loop.SetDeferredFlush(true);
+
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeTcpPair(server, client));
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        const std::string rsp("bye");
+        ASSERT_TRUE(conn->SendPacket(rsp.data(), rsp.size()));
+        conn->Shutdown(ananas::ShutdownMode::eSM_Write);
+
+        EXPECT_EQ(ReadExactly(client, rsp.size()), rsp);
+        char c;
+        EXPECT_EQ(::recv(client, &c, 1, 0), 0);
+        ::close(client);
+    });
+}
+
+TEST(connection, send_file_with_offset) {
+    RunInThread([]() {
+        EventLoop loop;
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeUnixPair(server, client));
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        int completes = 0;
+        conn->SetOnWriteComplete([&completes](Connection* ) {
+            ++ completes;
+        });
+
+        const std::string content = MakeContent(64 * 1024);
+        int fd = MakeTempFile(content);
+        ASSERT_NE(fd, -1);
+
+        ASSERT_TRUE(conn->SendFile(fd, 1000, 20000));
+        ::close(fd); // dup-ed by SendFile
+
+        EXPECT_EQ(conn->PendingSendBytes(), 0U);
+        EXPECT_EQ(completes, 1);
+        EXPECT_EQ(ReadExactly(client, 20000), content.substr(1000, 20000));
+        ::close(client);
+    });
+}
+
+TEST(connection, send_file_keeps_order) {
+    RunInThread([]() {
+        EventLoop loop;
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeUnixPair(server, client));
+        // file can't be sent at once, trailer must wait for it
+        ananas::SetSndBuf(server, 4096);
+
+        auto conn = std::make_shared<Connection>(&loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop.Register(ananas::internal::eET_Read, conn));
+
+        const std::string header("header\r\n");
+        const std::string trailer("\r\ntrailer");
+        const std::string content = MakeContent(256 * 1024);
+        int fd = MakeTempFile(content);
+        ASSERT_NE(fd, -1);
+
+        ASSERT_TRUE(conn->SendPacket(header));
+
+        int completes = 0;
+        conn->SetOnWriteComplete([&completes](Connection* ) {
+            ++ completes;
+        });
+
+        ASSERT_TRUE(conn->SendFile(fd, 0, content.size()));
+        ::close(fd);
+        ASSERT_TRUE(conn->SendPacket(trailer));
+        EXPECT_GT(conn->PendingSendBytes(), 0U);
+
+        // loop would call it when socket is writable
+        std::string received;
+        while (conn->PendingSendBytes() > 0) {
+            received += ReadAvailable(client);
+            ASSERT_TRUE(conn->HandleWriteEvent());
+        }
+
+        const std::string expect = header + content + trailer;
+        received += ReadExactly(client, expect.size() - received.size());
+        EXPECT_TRUE(received == expect);
+        EXPECT_EQ(completes, 1);
+        ::close(client);
+    });
+}
+
+#if defined(__gnu_linux__)
+TEST(connection, send_file_from_pipe_filled_later) {
+    RunInProcess([]() {
+        auto& app = Application::Instance();
+        EventLoop* loop = app.BaseLoop();
+
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeUnixPair(server, client));
+
+        auto conn = std::make_shared<Connection>(loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop->Register(ananas::internal::eET_Read, conn));
+
+        int completes = 0;
+        conn->SetOnWriteComplete([&completes, &app](Connection* ) {
+            ++ completes;
+            app.Exit();
+        });
+
+        int pipefd[2];
+        ASSERT_EQ(::pipe2(pipefd, O_NONBLOCK), 0);
+
+        // pipe is empty now, connection waits for it
+        const std::string data("data from pipe");
+        ASSERT_TRUE(conn->SendFile(pipefd[0], 0, data.size()));
+        ::close(pipefd[0]);
+        EXPECT_EQ(conn->PendingSendBytes(), data.size());
+        EXPECT_EQ(completes, 0);
+
+        loop->ScheduleAfter(std::chrono::milliseconds(50), [&]() {
+            EXPECT_EQ(ReadAvailable(client), "");
+            EXPECT_EQ(::write(pipefd[1], data.data(), data.size()),
+                      static_cast<ssize_t>(data.size()));
+        });
+
+        RunApplication(std::chrono::seconds(5));
+
+        EXPECT_EQ(completes, 1);
+        EXPECT_EQ(conn->PendingSendBytes(), 0U);
+        EXPECT_EQ(ReadExactly(client, data.size()), data);
+        ::close(pipefd[1]);
+        ::close(client);
+    });
+}
+#endif
+
+namespace {
+
+// Peer doesn't read, responses pile up until high water mark
+void TestWaterMark(bool et) {
+    RunInProcess([et]() {
+        auto& app = Application::Instance();
+        app.SetEdgeTriggered(et);
+        EventLoop* loop = app.BaseLoop();
+
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeUnixPair(server, client));
+        ananas::SetSndBuf(server, 4096);
+
+        auto conn = std::make_shared<Connection>(loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop->Register(ananas::internal::eET_Read, conn));
+
+        conn->SetWaterMark(16 * 1024, 64 * 1024);
+        conn->SetPauseReadOnHighWater(true);
+
+        int highs = 0, lows = 0;
+        conn->SetOnHighWater([&highs](Connection* , std::size_t pending) {
+            EXPECT_GE(pending, 64 * 1024U);
+            ++ highs;
+        });
+        conn->SetOnLowWater([&lows](Connection* c) {
+            EXPECT_LE(c->PendingSendBytes(), 16 * 1024U);
+            ++ lows;
+        });
+
+        std::string request;
+        conn->SetOnMessage([&](Connection* c, const char* data, size_t len) {
+            EXPECT_FALSE(c->IsReadPaused());
+            EXPECT_EQ(lows, 1);
+            request.append(data, len);
+            app.Exit();
+            return len;
+        });
+
+        const std::string chunk(32 * 1024, 'r');
+        const std::size_t total = 5 * chunk.size();
+        for (int i = 0; i < 5; ++ i)
+            ASSERT_TRUE(conn->SendPacket(chunk));
+
+        EXPECT_EQ(highs, 1);
+        EXPECT_TRUE(conn->IsReadPaused());
+
+        // sent when read is paused, not received until low water mark
+        ASSERT_EQ(::send(client, "ping", 4, 0), 4);
+
+        std::size_t received = 0;
+        using std::chrono::milliseconds;
+        loop->ScheduleAfter(milliseconds(50), [&]() {
+            EXPECT_TRUE(request.empty());
+            EXPECT_TRUE(conn->IsReadPaused());
+            EXPECT_EQ(lows, 0);
+
+            // peer begins to read
+            loop->ScheduleAfterWithRepeat<ananas::kForever>(milliseconds(1), [&]() {
+                received += ReadAvailable(client).size();
+            });
+        });
+
+        RunApplication(std::chrono::seconds(5));
+
+        EXPECT_EQ(request, "ping");
+        EXPECT_EQ(highs, 1);
+        EXPECT_EQ(lows, 1);
+        // the rest is below low water mark
+        received += ReadAvailable(client).size();
+        EXPECT_LE(conn->PendingSendBytes(), 16 * 1024U);
+        EXPECT_EQ(received + conn->PendingSendBytes(), total);
+        ::close(client);
+    });
+}
+
+} // end namespace
+
+TEST(connection, water_mark_pauses_and_resumes_read) {
+    TestWaterMark(false);
+}
+
+// data arrived when paused fires no event again
+TEST(connection, water_mark_pauses_and_resumes_read_et) {
+    TestWaterMark(true);
+}
+
+// Data of each thread arrives in order, only the first SafeSend posts a flush.
+TEST(connection, concurrent_safe_send) {
+    RunInProcess([]() {
+        auto& app = Application::Instance();
+        EventLoop* loop = app.BaseLoop();
+
+        int server = -1, client = -1;
+        ASSERT_TRUE(MakeUnixPair(server, client));
+
+        auto conn = std::make_shared<Connection>(loop);
+        ASSERT_TRUE(conn->Init(server, ananas::SocketAddr()));
+        ASSERT_TRUE(loop->Register(ananas::internal::eET_Read, conn));
+
+        struct Record {
+            uint32_t thread;
+            uint32_t seq;
+        };
+        const int kThreads = 4;
+        const uint32_t kRecords = 2000;
+        const std::size_t total = kThreads * kRecords * sizeof(Record);
+
+        const std::size_t before = loop->PostedTasks();
+        std::atomic<bool> start {false};
+        std::vector<std::thread> producers;
+        for (int t = 0; t < kThreads; ++ t) {
+            producers.emplace_back([&, t]() {
+                while (!start.load())
+                    std::this_thread::yield();
+
+                for (uint32_t i = 0; i < kRecords; ++ i) {
+                    Record rec {static_cast<uint32_t>(t), i};
+                    EXPECT_TRUE(conn->SafeSend(IOBuf(&rec, sizeof rec)));
+                }
+            });
+        }
+
+        start = true;
+        for (auto& t : producers)
+            t.join();
+
+        // loop is not running, nothing flushed yet
+        EXPECT_EQ(loop->PostedTasks() - before, 1U);
+
+        std::string received;
+        loop->ScheduleAfterWithRepeat<ananas::kForever>(std::chrono::milliseconds(1), [&]() {
+            received += ReadAvailable(client);
+            if (received.size() >= total)
+                app.Exit();
+        });
+
+        RunApplication(std::chrono::seconds(5));
+
+        ASSERT_EQ(received.size(), total);
+        uint32_t next[kThreads] = {0};
+        for (std::size_t off = 0; off < total; off += sizeof(Record)) {
+            Record rec;
+            ::memcpy(&rec, &received[off], sizeof rec);
+            ASSERT_LT(rec.thread, static_cast<uint32_t>(kThreads));
+            ASSERT_EQ(rec.seq, next[rec.thread]);
+            ++ next[rec.thread];
+        }
+
+        for (int t = 0; t < kThreads; ++ t)
+            EXPECT_EQ(next[t], kRecords);
+
+        ::close(client);
+    });
+}
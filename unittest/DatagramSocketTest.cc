@@ -0,0 +1,367 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "gtest/gtest.h"
+#include "net/DatagramSocket.h"
+#include "net/EventLoop.h"
+#include "util/BufferPool.h"
+#include "TestUtil.h"
+
+using ananas::Datagram;
+using ananas::DatagramSocket;
+using ananas::EventLoop;
+using ananas::test::RunInThread;
+
+namespace {
+
+// packets sendmmsg can send before send buffer is "full"
+std::size_t g_sendQuota = SIZE_MAX;
+
+} // end namespace
+
+#if defined(__gnu_linux__)
+// UDP never blocks on loopback, so would block is simulated by g_sendQuota
+extern "C" int sendmmsg(int fd, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+    using SendmmsgFunc = int (*)(int, struct mmsghdr*, unsigned int, int);
+    static SendmmsgFunc realSendmmsg = reinterpret_cast<SendmmsgFunc>(::dlsym(RTLD_NEXT, "sendmmsg"));
+
+    if (g_sendQuota == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (vlen > g_sendQuota)
+        vlen = static_cast<unsigned int>(g_sendQuota);
+
+    int n = realSendmmsg(fd, msgs, vlen, flags);
+    if (n > 0 && g_sendQuota != SIZE_MAX)
+        g_sendQuota -= static_cast<std::size_t>(n);
+
+    return n;
+}
+#endif
+
+namespace {
+
+ananas::SocketAddr LocalAddr(int sock) {
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof addr;
+    ::getsockname(sock, (sockaddr*)&addr, &addrLen);
+    return ananas::SocketAddr(addr);
+}
+
+// send packets of size len to bound udp socket
+void SendPackets(int sock, std::size_t count, std::size_t len) {
+    sockaddr_in addr;
+    socklen_t addrLen = sizeof addr;
+    ASSERT_EQ(::getsockname(sock, (sockaddr*)&addr, &addrLen), 0);
+
+    int client = ::socket(AF_INET, SOCK_DGRAM, 0);
+    const std::string data(len, 'u');
+    for (std::size_t i = 0; i < count; ++ i)
+        ASSERT_EQ(::sendto(client, data.data(), data.size(), 0, (sockaddr*)&addr, addrLen),
+                  static_cast<ssize_t>(data.size()));
+    ::close(client);
+}
+
+// 10 x 1200 + 500 bytes, split by kernel or by SendPacketSegmented itself
+void TestSegmented(bool gro) {
+    RunInThread([gro]() {
+        EventLoop loop;
+        auto receiver = std::make_shared<DatagramSocket>(&loop);
+        // before Bind, it's set by Bind
+        ASSERT_TRUE(receiver->SetGro(gro));
+
+        std::string received;
+        std::vector<std::size_t> lens;
+        receiver->SetMessageCallback([&](DatagramSocket* , const char* data, size_t len) {
+            received.append(data, len);
+            lens.push_back(len);
+        });
+
+        ananas::SocketAddr addr("127.0.0.1", 0);
+        ASSERT_TRUE(receiver->Bind(&addr));
+        const ananas::SocketAddr dst = LocalAddr(receiver->Identifier());
+
+        auto sender = std::make_shared<DatagramSocket>(&loop);
+        ASSERT_TRUE(sender->Bind(nullptr));
+
+        std::string data(10 * 1200 + 500, '\0');
+        for (std::size_t i = 0; i < data.size(); ++ i)
+            data[i] = static_cast<char>(i % 251);
+
+        ASSERT_TRUE(sender->SendPacketSegmented(data.data(), data.size(), 1200, &dst));
+        EXPECT_TRUE(receiver->HandleReadEvent());
+
+        ASSERT_EQ(lens.size(), 11U);
+        for (std::size_t i = 0; i < 10; ++ i)
+            EXPECT_EQ(lens[i], 1200U);
+        EXPECT_EQ(lens[10], 500U);
+        EXPECT_TRUE(received == data);
+    });
+}
+
+void TestResizeInCallback(std::size_t initBatch) {
+    RunInThread([initBatch]() {
+        EventLoop loop;
+        auto s = std::make_shared<DatagramSocket>(&loop);
+        s->SetBatchSize(initBatch);
+
+        std::vector<std::size_t> lens;
+        s->SetMessageCallback([&lens](DatagramSocket* s, const char* , size_t len) {
+            // bigger slots after first packet
+            if (lens.empty()) {
+                s->SetBatchSize(DatagramSocket::kMaxBatchSize);
+                s->SetMaxPacketSize(8192);
+            }
+            lens.push_back(len);
+        });
+
+        ananas::SocketAddr addr("127.0.0.1", 0);
+        ASSERT_TRUE(s->Bind(&addr));
+
+        const std::size_t kCount = 16; // fits in default rcvbuf
+        const std::size_t kLen = 6000;
+        SendPackets(s->Identifier(), kCount, kLen);
+
+        EXPECT_TRUE(s->HandleReadEvent());
+        ASSERT_EQ(lens.size(), kCount);
+        // first batch is truncated by default max packet size
+        for (std::size_t i = 0; i < initBatch; ++ i)
+            EXPECT_EQ(lens[i], 2048U);
+        for (std::size_t i = initBatch; i < kCount; ++ i)
+            EXPECT_EQ(lens[i], kLen);
+    });
+}
+
+// raw udp socket bound to loopback
+int MakeReceiver() {
+    int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    ::memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(sock, (sockaddr*)&addr, sizeof addr) != 0) {
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+std::vector<std::string> RecvAvailable(int sock) {
+    std::vector<std::string> packets;
+    char buf[2048];
+    ssize_t n;
+    while ((n = ::recv(sock, buf, sizeof buf, MSG_DONTWAIT)) >= 0)
+        packets.push_back(std::string(buf, static_cast<std::size_t>(n)));
+
+    return packets;
+}
+
+std::string MakePacket(std::size_t i) {
+    return "packet " + std::to_string(i);
+}
+
+} // end namespace
+
+#if defined(__gnu_linux__)
+TEST(datagram_socket, segmented_send) {
+    TestSegmented(false);
+}
+
+TEST(datagram_socket, segmented_send_gro_receive) {
+    TestSegmented(true);
+}
+#endif
+
+TEST(datagram_socket, resize_in_callback_single) {
+    TestResizeInCallback(1);
+}
+
+TEST(datagram_socket, resize_in_callback_batch) {
+    TestResizeInCallback(4);
+}
+
+TEST(datagram_socket, batch_message_callback) {
+    RunInThread([]() {
+        EventLoop loop;
+        auto s = std::make_shared<DatagramSocket>(&loop);
+        s->SetBatchSize(4);
+
+        std::vector<std::size_t> counts;
+        std::vector<std::string> packets;
+        std::vector<ananas::SocketAddr> peers;
+        bool single = false;
+        s->SetMessageCallback([&single](DatagramSocket* , const char* , size_t ) {
+            single = true;
+        });
+        s->SetBatchMessageCallback([&](DatagramSocket* s, const Datagram* msgs, size_t count) {
+            counts.push_back(count);
+            for (std::size_t i = 0; i < count; ++ i) {
+                packets.push_back(std::string(msgs[i].data, msgs[i].len));
+                peers.push_back(msgs[i].peer);
+            }
+            EXPECT_EQ(s->PeerAddr(), msgs[count - 1].peer);
+        });
+
+        ananas::SocketAddr addr("127.0.0.1", 0);
+        ASSERT_TRUE(s->Bind(&addr));
+        const ananas::SocketAddr dst = LocalAddr(s->Identifier());
+
+        int client = MakeReceiver(); // bound, so peer address is known
+        ASSERT_NE(client, -1);
+        const std::size_t kCount = 10;
+        for (std::size_t i = 0; i < kCount; ++ i) {
+            const std::string data = MakePacket(i);
+            ASSERT_EQ(::sendto(client, data.data(), data.size(), 0, (const sockaddr*)&dst, sizeof dst),
+                      static_cast<ssize_t>(data.size()));
+        }
+
+        EXPECT_TRUE(s->HandleReadEvent());
+        EXPECT_FALSE(single);
+
+#if defined(__gnu_linux__)
+        // one callback per recvmmsg
+        EXPECT_EQ(counts, std::vector<std::size_t>({4, 4, 2}));
+#endif
+        ASSERT_EQ(packets.size(), kCount);
+        const ananas::SocketAddr clientAddr = LocalAddr(client);
+        for (std::size_t i = 0; i < kCount; ++ i) {
+            EXPECT_EQ(packets[i], MakePacket(i));
+            EXPECT_EQ(peers[i], clientAddr);
+        }
+
+        ::close(client);
+    });
+}
+
+#if defined(__gnu_linux__)
+// packets sendmmsg can't take are queued in order, sent by write event
+TEST(datagram_socket, send_packets_partially_queued) {
+    RunInThread([]() {
+        EventLoop loop;
+        int receiver = MakeReceiver();
+        ASSERT_NE(receiver, -1);
+        const ananas::SocketAddr dst = LocalAddr(receiver);
+
+        auto s = std::make_shared<DatagramSocket>(&loop);
+        ASSERT_TRUE(s->Bind(nullptr));
+
+        const std::size_t kCount = 40;
+        std::vector<std::string> data;
+        for (std::size_t i = 0; i < kCount; ++ i)
+            data.push_back(MakePacket(i));
+
+        std::vector<Datagram> msgs;
+        for (const auto& d : data)
+            msgs.push_back(Datagram {d.data(), d.size(), dst});
+
+        g_sendQuota = 10;
+        EXPECT_TRUE(s->SendPackets(msgs.data(), msgs.size()));
+        EXPECT_EQ(s->QueuedPackets(), kCount - 10);
+
+        // queued behind them
+        const std::string last = MakePacket(kCount);
+        EXPECT_TRUE(s->SendPacket(last.data(), last.size(), &dst));
+        EXPECT_EQ(s->QueuedPackets(), kCount - 10 + 1);
+
+        // still would block
+        g_sendQuota = 5;
+        EXPECT_TRUE(s->HandleWriteEvent());
+        EXPECT_EQ(s->QueuedPackets(), kCount - 15 + 1);
+
+        g_sendQuota = SIZE_MAX;
+        EXPECT_TRUE(s->HandleWriteEvent());
+        EXPECT_EQ(s->QueuedPackets(), 0U);
+
+        const auto packets = RecvAvailable(receiver);
+        ASSERT_EQ(packets.size(), kCount + 1);
+        for (std::size_t i = 0; i <= kCount; ++ i)
+            EXPECT_EQ(packets[i], MakePacket(i));
+
+        ::close(receiver);
+    });
+}
+
+namespace {
+
+// queue packets [begin, end) while sendmmsg would block
+void QueuePackets(DatagramSocket* s, std::size_t begin, std::size_t end,
+                  const ananas::SocketAddr& dst) {
+    std::vector<std::string> data;
+    std::vector<Datagram> msgs;
+    for (std::size_t i = begin; i < end; ++ i)
+        data.push_back(MakePacket(i));
+    for (const auto& d : data)
+        msgs.push_back(Datagram {d.data(), d.size(), dst});
+
+    g_sendQuota = 0;
+    const std::size_t queued = s->QueuedPackets();
+    EXPECT_TRUE(s->SendPackets(msgs.data(), msgs.size()));
+    EXPECT_EQ(s->QueuedPackets(), queued + msgs.size());
+}
+
+} // end namespace
+
+// Ring wraps around and grows when full, packets keep order;
+// package memory is reused from BufferPool after that.
+TEST(datagram_socket, send_ring_wrap_and_grow) {
+    RunInThread([]() {
+        EventLoop loop;
+        int receiver = MakeReceiver();
+        ASSERT_NE(receiver, -1);
+        const ananas::SocketAddr dst = LocalAddr(receiver);
+
+        auto s = std::make_shared<DatagramSocket>(&loop);
+        ASSERT_TRUE(s->Bind(nullptr));
+
+        // ring of 16, head moves to 8
+        QueuePackets(s.get(), 0, 10, dst);
+        g_sendQuota = 8;
+        EXPECT_TRUE(s->HandleWriteEvent());
+        EXPECT_EQ(s->QueuedPackets(), 2U);
+
+        // wraps around
+        QueuePackets(s.get(), 10, 24, dst);
+        EXPECT_EQ(s->QueuedPackets(), 16U);
+        // grows when wrapped
+        QueuePackets(s.get(), 24, 40, dst);
+        EXPECT_EQ(s->QueuedPackets(), 32U);
+
+        g_sendQuota = SIZE_MAX;
+        EXPECT_TRUE(s->HandleWriteEvent());
+        EXPECT_EQ(s->QueuedPackets(), 0U);
+
+        auto packets = RecvAvailable(receiver);
+        ASSERT_EQ(packets.size(), 40U);
+        for (std::size_t i = 0; i < packets.size(); ++ i)
+            EXPECT_EQ(packets[i], MakePacket(i));
+
+        // ring is big enough now, blocks of sent packets are cached
+        const ananas::BufferPoolStats before = ananas::BufferPool::ThreadStats();
+        for (int round = 0; round < 3; ++ round) {
+            QueuePackets(s.get(), 0, 32, dst);
+            g_sendQuota = SIZE_MAX;
+            EXPECT_TRUE(s->HandleWriteEvent());
+            EXPECT_EQ(s->QueuedPackets(), 0U);
+        }
+
+        const ananas::BufferPoolStats& after = ananas::BufferPool::ThreadStats();
+        EXPECT_EQ(after.allocs - before.allocs, 3 * 32U);
+        EXPECT_EQ(after.hits - before.hits, 3 * 32U);
+
+        packets = RecvAvailable(receiver);
+        EXPECT_EQ(packets.size(), 3 * 32U);
+        ::close(receiver);
+    });
+}
+#endif
@@ -0,0 +1,170 @@
+#include <memory>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "gtest/gtest.h"
+#include "net/EventLoop.h"
+#include "net/Socket.h"
+#include "TestUtil.h"
+
+using ananas::Application;
+using ananas::EventLoop;
+using ananas::PollerType;
+using ananas::internal::eET_Read;
+using ananas::internal::eET_Write;
+using ananas::test::RunApplication;
+using ananas::test::RunInProcess;
+
+namespace {
+
+// counts events of one end of socket pair
+class CountChannel : public ananas::internal::Channel {
+public:
+    explicit
+    CountChannel(int fd) : fd_(fd) {
+        ananas::SetNonBlock(fd_);
+    }
+    ~CountChannel() {
+        ::close(fd_);
+    }
+
+    int Identifier() const override {
+        return fd_;
+    }
+
+    bool HandleReadEvent() override {
+        ++ reads;
+        char buf[64];
+        while (::recv(fd_, buf, sizeof buf, 0) > 0)
+            ;
+        return true;
+    }
+
+    bool HandleWriteEvent() override {
+        ++ writes;
+        return true;
+    }
+
+    void HandleErrorEvent() override {
+        ++ errors;
+    }
+
+    int reads = 0;
+    int writes = 0;
+    int errors = 0;
+
+private:
+    const int fd_;
+};
+
+void Poke(int fd) {
+    EXPECT_EQ(::send(fd, "x", 1, 0), 1);
+}
+
+class EventLoopTest : public testing::TestWithParam<PollerType> {
+};
+
+} // end namespace
+
+TEST_P(EventLoopTest, register_modify_unregister) {
+    const PollerType type = GetParam();
+    RunInProcess([type]() {
+        auto& app = Application::Instance();
+        app.SetPollerType(type);
+        EventLoop* loop = app.BaseLoop();
+
+        int sv[2];
+        ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        auto ch = std::make_shared<CountChannel>(sv[0]);
+        ASSERT_TRUE(loop->Register(eET_Read, ch));
+
+        using std::chrono::milliseconds;
+        loop->ScheduleAfter(milliseconds(20), [&]() {
+            Poke(sv[1]);
+        });
+
+        loop->ScheduleAfter(milliseconds(60), [&]() {
+            EXPECT_GE(ch->reads, 1);
+            EXPECT_EQ(ch->writes, 0);
+            EXPECT_TRUE(loop->Modify(eET_Read | eET_Write, ch));
+        });
+
+        int writes = 0;
+        int reads = 0;
+        loop->ScheduleAfter(milliseconds(100), [&]() {
+            EXPECT_GE(ch->writes, 1);
+            EXPECT_TRUE(loop->Modify(eET_Read, ch));
+            writes = ch->writes;
+            reads = ch->reads;
+            Poke(sv[1]);
+        });
+
+        loop->ScheduleAfter(milliseconds(140), [&]() {
+            EXPECT_EQ(ch->writes, writes);
+            EXPECT_GT(ch->reads, reads);
+
+            loop->Unregister(eET_Read | eET_Write, ch);
+            reads = ch->reads;
+            Poke(sv[1]);
+        });
+
+        loop->ScheduleAfter(milliseconds(180), [&]() {
+            EXPECT_EQ(ch->reads, reads);
+            EXPECT_EQ(ch->errors, 0);
+            app.Exit();
+        });
+
+        RunApplication(std::chrono::seconds(5));
+        ::close(sv[1]);
+    });
+}
+
+// For io_uring each Modify takes two submission entries, far more than SQ
+// can hold; it must be submitted in time, the last interest wins.
+TEST_P(EventLoopTest, many_modifies_in_one_iteration) {
+    const PollerType type = GetParam();
+    RunInProcess([type]() {
+        auto& app = Application::Instance();
+        app.SetPollerType(type);
+        EventLoop* loop = app.BaseLoop();
+
+        int sv[2];
+        ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        auto ch = std::make_shared<CountChannel>(sv[0]);
+        ASSERT_TRUE(loop->Register(eET_Read, ch));
+
+        using std::chrono::milliseconds;
+        loop->ScheduleAfter(milliseconds(20), [&]() {
+            bool succ = true;
+            for (int i = 0; i < 5000; ++ i)
+                succ = loop->Modify((i % 2) ? eET_Read | eET_Write : eET_Read, ch) && succ;
+
+            EXPECT_TRUE(succ);
+            EXPECT_TRUE(loop->Modify(eET_Read | eET_Write, ch));
+            Poke(sv[1]);
+        });
+
+        int writes = 0;
+        loop->ScheduleAfter(milliseconds(80), [&]() {
+            EXPECT_GE(ch->reads, 1);
+            EXPECT_GE(ch->writes, 1);
+
+            EXPECT_TRUE(loop->Modify(eET_Read, ch));
+            writes = ch->writes;
+        });
+
+        loop->ScheduleAfter(milliseconds(120), [&]() {
+            // polls replaced before are all gone
+            EXPECT_EQ(ch->writes, writes);
+            EXPECT_EQ(ch->errors, 0);
+            app.Exit();
+        });
+
+        RunApplication(std::chrono::seconds(5));
+        ::close(sv[1]);
+    });
+}
+
+INSTANTIATE_TEST_CASE_P(poller, EventLoopTest,
+                         testing::Values(PollerType::ePT_Default, PollerType::ePT_IoUring));
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "future/Future.h"
+
+TEST(future, then_after_set) {
+    ananas::Promise<int> pm;
+    auto fut = pm.GetFuture();
+    pm.SetValue(1);
+    EXPECT_TRUE(pm.IsReady());
+
+    int got = 0;
+    fut.Then([&got](int v) {
+        got = v;
+    });
+    EXPECT_EQ(got, 1);
+}
+
+TEST(future, set_after_then) {
+    ananas::Promise<int> pm;
+    auto fut = pm.GetFuture();
+
+    int got = 0;
+    auto next = fut.Then([&got](int v) {
+        got = v;
+        return v + 1;
+    });
+    EXPECT_FALSE(pm.IsReady());
+    EXPECT_EQ(got, 0);
+
+    pm.SetValue(1);
+    EXPECT_EQ(got, 1);
+    EXPECT_EQ(next.Wait().Value(), 2);
+}
+
+TEST(future, set_only_once) {
+    ananas::Promise<int> pm;
+    auto fut = pm.GetFuture();
+    pm.SetValue(1);
+    pm.SetValue(2);
+    pm.SetException(std::make_exception_ptr(std::runtime_error("late")));
+
+    EXPECT_EQ(fut.Wait().Value(), 1);
+    // retrieved already
+    EXPECT_THROW(fut.Wait(), std::runtime_error);
+}
+
+TEST(future, exception) {
+    ananas::Promise<void> pm;
+    auto fut = pm.GetFuture();
+
+    bool failed = false;
+    fut.Then([&failed](ananas::Try<void>&& t) {
+        failed = t.HasException();
+    });
+
+    pm.SetException(std::make_exception_ptr(std::runtime_error("fail")));
+    EXPECT_TRUE(failed);
+}
+
+// SetValue and Then race in two threads, callback must run exactly once
+TEST(future, race_set_and_then) {
+    const int kRounds = 20000;
+    for (int i = 0; i < kRounds; ++ i) {
+        ananas::Promise<int> pm;
+        auto fut = pm.GetFuture();
+
+        std::atomic<int> called {0};
+        std::atomic<int> value {0};
+        std::thread setter([&pm, i]() {
+            pm.SetValue(i);
+        });
+
+        fut.Then([&called, &value](int v) {
+            value = v;
+            ++ called;
+        });
+
+        setter.join();
+        ASSERT_EQ(called.load(), 1);
+        ASSERT_EQ(value.load(), i);
+    }
+}
+
+TEST(future, wait_in_other_thread) {
+    ananas::Promise<int> pm;
+    auto fut = pm.GetFuture();
+
+    std::thread setter([&pm]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pm.SetValue(42);
+    });
+
+    EXPECT_EQ(fut.Wait(std::chrono::milliseconds(5000)).Value(), 42);
+    setter.join();
+}
@@ -0,0 +1,105 @@
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "util/IOBuf.h"
+
+using ananas::Buffer;
+using ananas::IOBuf;
+
+TEST(iobuf, append_and_copy) {
+    IOBuf buf;
+    EXPECT_TRUE(buf.Empty());
+
+    buf.Append("hello", 5);
+    buf.Append(" world", 6);
+    EXPECT_EQ(buf.Size(), 11U);
+    EXPECT_EQ(buf.SegmentCount(), 1U); // small data goes to tail room
+    EXPECT_EQ(buf.ToString(), "hello world");
+
+    IOBuf big;
+    std::string data(IOBuf::kBlockSize * 2 + 7, 'x');
+    big.Append(data.data(), data.size());
+    EXPECT_EQ(big.ToString(), data);
+}
+
+TEST(iobuf, take_over) {
+    Buffer b("abc", 3);
+    const char* addr = b.ReadAddr();
+
+    IOBuf buf(std::move(b));
+    EXPECT_TRUE(b.IsEmpty());
+    EXPECT_EQ(buf.ToString(), "abc");
+
+    iovec iov[4];
+    ASSERT_EQ(buf.ToIovec(iov, 4), 1U);
+    EXPECT_EQ(iov[0].iov_base, addr); // no copy
+
+    buf.Append(std::string("def"));
+    buf.Append("g", 1); // can not write to tail of string
+    EXPECT_EQ(buf.SegmentCount(), 3U);
+    EXPECT_EQ(buf.ToString(), "abcdefg");
+}
+
+TEST(iobuf, share) {
+    IOBuf a("0123456789", 10);
+    IOBuf b(a);
+    b.Append("ab", 2); // a's block is shared, not written
+    EXPECT_EQ(a.ToString(), "0123456789");
+    EXPECT_EQ(b.ToString(), "0123456789ab");
+
+    IOBuf s = b.Slice(8, 3);
+    EXPECT_EQ(s.ToString(), "89a");
+    EXPECT_EQ(s.SegmentCount(), 2U);
+
+    EXPECT_TRUE(b.Slice(20, 1).Empty());
+    EXPECT_EQ(b.Slice(5, 100).ToString(), "56789ab");
+
+    char out[4] = {0};
+    EXPECT_EQ(b.CopyTo(out, 3, 9), 3U);
+    EXPECT_EQ(std::string(out, 3), "9ab");
+}
+
+TEST(iobuf, trim) {
+    IOBuf buf("0123", 4);
+    buf.Append(std::string("4567"));
+    buf.Append(std::string("89"));
+
+    buf.TrimStart(5);
+    EXPECT_EQ(buf.ToString(), "56789");
+    EXPECT_EQ(buf.SegmentCount(), 2U);
+
+    buf.TrimEnd(3);
+    EXPECT_EQ(buf.ToString(), "56");
+
+    buf.TrimStart(2);
+    EXPECT_TRUE(buf.Empty());
+    EXPECT_EQ(buf.SegmentCount(), 0U);
+}
+
+TEST(iobuf, prepend) {
+    IOBuf buf = IOBuf::WithHeadroom(4);
+    buf.Append("body", 4);
+    buf.Prepend("hd", 2);
+    buf.Prepend("HD", 2);
+    EXPECT_EQ(buf.SegmentCount(), 1U); // all in headroom
+    EXPECT_EQ(buf.ToString(), "HDhdbody");
+
+    buf.Prepend("x", 1);
+    EXPECT_EQ(buf.SegmentCount(), 2U);
+    EXPECT_EQ(buf.ToString(), "xHDhdbody");
+}
+
+TEST(iobuf, append_space) {
+    IOBuf buf;
+    char* p = buf.AppendSpace(3);
+    memcpy(p, "abc", 3);
+    buf.Produce(3);
+
+    IOBuf other("def", 3);
+    buf.Append(std::move(other));
+    EXPECT_TRUE(other.Empty());
+    EXPECT_EQ(buf.ToString(), "abcdef");
+}
+
@@ -0,0 +1,75 @@
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "util/MpscQueue.h"
+
+namespace {
+
+struct Node : public ananas::MpscNode {
+    explicit
+    Node(int p, int v) : producer(p), value(v) {}
+
+    int producer;
+    int value;
+};
+
+} // end namespace
+
+TEST(mpsc, single_thread) {
+    ananas::MpscQueue<Node> q;
+    EXPECT_TRUE(q.Empty());
+    EXPECT_EQ(q.Pop(), nullptr);
+
+    for (int i = 0; i < 10; ++ i)
+        q.Push(new Node(0, i));
+
+    EXPECT_FALSE(q.Empty());
+
+    for (int i = 0; i < 10; ++ i) {
+        Node* n = q.Pop();
+        ASSERT_NE(n, nullptr);
+        EXPECT_EQ(n->value, i);
+        delete n;
+    }
+
+    EXPECT_EQ(q.Pop(), nullptr);
+    EXPECT_TRUE(q.Empty());
+}
+
+TEST(mpsc, multi_producer) {
+    const int kProducers = 4;
+    const int kCount = 100000;
+
+    ananas::MpscQueue<Node> q;
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++ p) {
+        producers.emplace_back([&q, p]() {
+            for (int i = 0; i < kCount; ++ i)
+                q.Push(new Node(p, i));
+        });
+    }
+
+    // FIFO for each producer
+    std::vector<int> expect(kProducers, 0);
+    int popped = 0;
+    while (popped < kProducers * kCount) {
+        Node* n = q.Pop();
+        if (!n) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        EXPECT_EQ(n->value, expect[n->producer]);
+        expect[n->producer] = n->value + 1;
+        ++ popped;
+        delete n;
+    }
+
+    for (auto& t : producers)
+        t.join();
+
+    EXPECT_EQ(q.Pop(), nullptr);
+}
@@ -0,0 +1,68 @@
+#ifndef BERT_TESTUTIL_H
+#define BERT_TESTUTIL_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "gtest/gtest-spi.h"
+#include "net/Application.h"
+
+namespace ananas {
+namespace test {
+
+// EventLoop is one per thread
+template <typename F>
+void RunInThread(F f) {
+    std::thread t(f);
+    t.join();
+}
+
+// Application can run only once in a process, EventLoop::Run depends on it.
+// So f runs in a new process of this test, failures in f fail the test,
+// they are printed to stderr which is the only output seen from child.
+template <typename F>
+void RunInProcess(F f) {
+    ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+    EXPECT_EXIT({
+        ::testing::TestPartResultArray results;
+        {
+            ::testing::ScopedFakeTestPartResultReporter reporter(
+                ::testing::ScopedFakeTestPartResultReporter::INTERCEPT_ALL_THREADS, &results);
+            f();
+        }
+
+        int failed = 0;
+        for (int i = 0; i < results.size(); ++ i) {
+            const auto& result = results.GetTestPartResult(i);
+            if (!result.failed())
+                continue;
+
+            ++ failed;
+            fprintf(stderr, "%s:%d: %s\n",
+                    result.file_name() ? result.file_name() : "unknown",
+                    result.line_number(), result.summary());
+        }
+
+        std::exit(failed ? 1 : 0);
+    }, ::testing::ExitedWithCode(0), "");
+}
+
+// Run application until Exit is called, fail if it takes too long
+inline void RunApplication(std::chrono::milliseconds timeout) {
+    auto& app = Application::Instance();
+    app.BaseLoop()->ScheduleAfter(timeout, [&app]() {
+        ADD_FAILURE() << "application timeout";
+        app.Exit();
+    });
+
+    app.Run(0, nullptr);
+}
+
+} // end namespace test
+} // end namespace ananas
+
+#endif
+
@@ -1,5 +1,6 @@
 
 #include "util/ThreadPool.h"
+#include "util/Affinity.h"
 #include "future/Future.h"
 
 #include <chrono>
@@ -116,6 +117,22 @@ TEST_F(ThreadPoolTest, join_test) {
                std::runtime_error);
 }
 
+TEST(affinity, parse_cpu_list) {
+  EXPECT_EQ(ananas::ParseCpuList("0-3,8,10-11"),
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(ananas::ParseCpuList("5"), std::vector<int>({5}));
+  EXPECT_TRUE(ananas::ParseCpuList("3-1").empty());
+  EXPECT_TRUE(ananas::ParseCpuList("a,b").empty());
+}
+
+#if defined(__gnu_linux__)
+TEST_F(ThreadPoolTest, affinity_test) {
+  pool_.SetCpuAffinity({0});
+
+  auto fut = pool_.Execute([]() { return ananas::CurrentCpu(); });
+  EXPECT_EQ(fut.Wait(), 0);
+}
+#endif
 
 int main(int argc, char **argv) {
   InitGoogleTest(&argc, argv);
@@ -0,0 +1,145 @@
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "util/Timer.h"
+
+using ananas::TimerId;
+using ananas::TimerMode;
+using ananas::internal::TimerManager;
+
+namespace {
+
+void RunUntil(TimerManager& timers, std::function<bool ()> done, int maxMs) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxMs);
+    while (!done() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        timers.Update();
+    }
+}
+
+class TimerTest : public testing::TestWithParam<TimerMode> {
+protected:
+    void SetUp() override {
+        ASSERT_TRUE(timers_.SetMode(GetParam()));
+    }
+
+    TimerManager timers_;
+};
+
+} // end namespace
+
+TEST(timer, id) {
+    TimerId id;
+    EXPECT_FALSE(id);
+    EXPECT_EQ(id.UniqueId(), 0U);
+
+    TimerManager timers;
+    id = timers.ScheduleAfter(std::chrono::seconds(1), []() {});
+    EXPECT_TRUE(id);
+    EXPECT_TRUE(id == id);
+
+    TimerId copy(id);
+    id.reset();
+    EXPECT_FALSE(id);
+    EXPECT_TRUE(timers.Cancel(copy));
+    EXPECT_FALSE(timers.Cancel(copy));
+    EXPECT_FALSE(timers.Cancel(id));
+}
+
+TEST_P(TimerTest, order) {
+    std::vector<int> fired;
+    timers_.ScheduleAfter(std::chrono::milliseconds(20), [&]() { fired.push_back(20); });
+    timers_.ScheduleAfter(std::chrono::milliseconds(3), [&]() { fired.push_back(3); });
+    timers_.ScheduleAfter(std::chrono::milliseconds(300), [&]() { fired.push_back(300); });
+    timers_.ScheduleAfter(std::chrono::milliseconds(10), [&]() { fired.push_back(10); });
+    EXPECT_EQ(timers_.Size(), 4U);
+
+    RunUntil(timers_, [&]() { return fired.size() == 4; }, 2000);
+
+    EXPECT_EQ(fired, std::vector<int>({3, 10, 20, 300}));
+    EXPECT_EQ(timers_.Size(), 0U);
+    EXPECT_EQ(timers_.NearestTimer(), ananas::DurationMs::max());
+}
+
+TEST_P(TimerTest, never_early) {
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point when;
+    timers_.ScheduleAfter(std::chrono::milliseconds(5), [&]() {
+        when = std::chrono::steady_clock::now();
+    });
+
+    RunUntil(timers_, [&]() { return timers_.Size() == 0; }, 1000);
+    EXPECT_GE(when - start, std::chrono::milliseconds(5));
+}
+
+TEST_P(TimerTest, repeat_and_cancel) {
+    int forever = 0, only3 = 0;
+    TimerId id = timers_.ScheduleAfterWithRepeat<ananas::kForever>(std::chrono::milliseconds(2),
+                                                                    [&]() { ++ forever; });
+    timers_.ScheduleAfterWithRepeat<3>(std::chrono::milliseconds(2), [&]() {
+        if (++ only3 == 2) {
+            EXPECT_TRUE(timers_.Cancel(id));
+        }
+    });
+
+    RunUntil(timers_, [&]() { return timers_.Size() == 0; }, 1000);
+
+    EXPECT_EQ(only3, 3);
+    EXPECT_GE(forever, 1);
+    EXPECT_LE(forever, 2);
+    EXPECT_FALSE(timers_.Cancel(id));
+}
+
+TEST_P(TimerTest, cancel_self_and_sibling) {
+    int a = 0, b = 0;
+    TimerId idA, idB;
+    const auto when = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+    idA = timers_.ScheduleAtWithRepeat<ananas::kForever>(when, std::chrono::milliseconds(1), [&]() {
+        ++ a;
+        EXPECT_TRUE(timers_.Cancel(idA));
+        timers_.Cancel(idB);
+    });
+    idB = timers_.ScheduleAtWithRepeat<ananas::kForever>(when, std::chrono::milliseconds(1), [&]() {
+        ++ b;
+        EXPECT_TRUE(timers_.Cancel(idB));
+        timers_.Cancel(idA);
+    });
+
+    RunUntil(timers_, [&]() { return timers_.Size() == 0; }, 1000);
+
+    // whoever runs first cancels the other
+    EXPECT_EQ(a + b, 1);
+}
+
+TEST_P(TimerTest, far_away) {
+    bool fired = false;
+    TimerId id = timers_.ScheduleAfter(std::chrono::hours(48), [&]() { fired = true; });
+    timers_.Update();
+    EXPECT_FALSE(fired);
+    EXPECT_GT(timers_.NearestTimer(), ananas::DurationMs(0));
+    EXPECT_FALSE(timers_.SetMode(TimerMode::eTM_Default));
+
+    EXPECT_TRUE(timers_.Cancel(id));
+    EXPECT_EQ(timers_.Size(), 0U);
+}
+
+TEST_P(TimerTest, many) {
+    const int kTimers = 10000;
+    std::vector<TimerId> ids;
+    int fired = 0;
+    for (int i = 0; i < kTimers; ++ i)
+        ids.push_back(timers_.ScheduleAfter(std::chrono::milliseconds(1 + i % 50), [&]() { ++ fired; }));
+
+    // cancel half of them
+    for (int i = 0; i < kTimers; i += 2)
+        EXPECT_TRUE(timers_.Cancel(ids[i]));
+
+    RunUntil(timers_, [&]() { return timers_.Size() == 0; }, 2000);
+    EXPECT_EQ(fired, kTimers / 2);
+}
+
+INSTANTIATE_TEST_CASE_P(mode, TimerTest,
+                        testing::Values(TimerMode::eTM_Default, TimerMode::eTM_Wheel));
+
@@ -0,0 +1,71 @@
+#include <cstdlib>
+
+#if defined(__gnu_linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "Util.h"
+#include "Affinity.h"
+
+namespace ananas {
+
+std::vector<int> ParseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    for (const auto& range : SplitString(list, ',')) {
+        if (range.empty())
+            continue;
+
+        char* end = nullptr;
+        const long first = std::strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = std::strtol(end + 1, &end, 10);
+
+        if (*end != '\0' || first < 0 || last < first)
+            return std::vector<int>();
+
+        for (long cpu = first; cpu <= last; ++ cpu)
+            cpus.push_back(static_cast<int>(cpu));
+    }
+
+    return cpus;
+}
+
+bool SetThreadAffinity(int cpu) {
+#if defined(__gnu_linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof set, &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+bool SetLocalMemPolicy() {
+#if defined(__gnu_linux__) && defined(SYS_set_mempolicy)
+    // no libnuma dependency
+    return ::syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+int CurrentCpu() {
+#if defined(__gnu_linux__)
+    return ::sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+} // namespace ananas
+
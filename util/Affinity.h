@@ -0,0 +1,30 @@
+#ifndef BERT_AFFINITY_H
+#define BERT_AFFINITY_H
+
+#include <string>
+#include <vector>
+
+///@file Affinity.h
+///@brief CPU & NUMA placement of threads, only work on linux
+namespace ananas {
+
+///@brief Parse cpu list like "0-3,8,10-11"
+///@return Empty vector if bad format
+std::vector<int> ParseCpuList(const std::string& list);
+
+///@brief Pin calling thread to cpu
+bool SetThreadAffinity(int cpu);
+
+///@brief Allocate memory from the node of calling thread's cpu
+///
+/// Call it after SetThreadAffinity, pages first touched by this thread
+/// will come from local node, whatever the process policy is.
+bool SetLocalMemPolicy();
+
+///@brief The cpu calling thread is running on, -1 if unknown
+int CurrentCpu();
+
+} // namespace ananas
+
+#endif
+
@@ -95,17 +95,28 @@ void Buffer::AssureSpace(std::size_t needsize) {
         }
     }
 
-    if (oldCap < capacity_) {
-        std::unique_ptr<char []> tmp(new char[capacity_]);
-
-        if (dataSize != 0)
-            memcpy(&tmp[0], &buffer_[readPos_], dataSize);
+    if (oldCap < capacity_ && _BlockSize() < capacity_) {
+        _Realloc(dataSize);
+        return;
+    }
 
-        buffer_.swap(tmp);
-    } else {
-        assert (readPos_ > 0);
+    // pool block may be bigger than capacity, no need to reallocate
+    if (readPos_ > 0 && dataSize != 0)
         ::memmove(&buffer_[0], &buffer_[readPos_], dataSize);
-    }
+
+    readPos_ = 0;
+    writePos_ = dataSize;
+}
+
+void Buffer::_Realloc(std::size_t dataSize) {
+    std::size_t blockSize = capacity_;
+    char* block = BufferPool::Allocate(blockSize);
+    std::unique_ptr<char [], internal::PoolDeleter> tmp(block, internal::PoolDeleter(blockSize));
+
+    if (dataSize != 0)
+        memcpy(&tmp[0], &buffer_[readPos_], dataSize);
+
+    buffer_.swap(tmp);
 
     readPos_ = 0;
     writePos_ = dataSize;
@@ -129,14 +140,23 @@ void Buffer::Shrink() {
         return;
 
     std::size_t newCap = RoundUp2Power(dataSize);
-
-    std::unique_ptr<char []> tmp(new char[newCap]);
-    memcpy(&tmp[0], &buffer_[readPos_], dataSize);
-    buffer_.swap(tmp);
     capacity_ = newCap;
 
-    readPos_  = 0;
-    writePos_ = dataSize;
+    // same size class, just move data to front
+    std::size_t blockSize = newCap;
+    if (blockSize < BufferPool::kMinClass)
+        blockSize = BufferPool::kMinClass;
+
+    if (blockSize >= _BlockSize()) {
+        if (readPos_ > 0)
+            ::memmove(&buffer_[0], &buffer_[readPos_], dataSize);
+
+        readPos_  = 0;
+        writePos_ = dataSize;
+        return;
+    }
+
+    _Realloc(dataSize);
 }
 
 void Buffer::Clear() {
@@ -165,6 +185,7 @@ Buffer& Buffer::_MoveFrom(Buffer&& other) {
         this->capacity_ = other.capacity_;
         this->buffer_ = std::move(other.buffer_);
 
+        other.capacity_ = 0; // it has no memory now
         other.Clear();
         other.Shrink();
     }
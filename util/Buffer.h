@@ -6,10 +6,14 @@
 #include <memory>
 #include <list>
 
+#include "BufferPool.h"
+
 ///@file Buffer.h
 namespace ananas {
 
 ///@brief A simple buffer with memory management like STL's vector<char>
+///
+/// Memory comes from BufferPool, the real block may be bigger than Capacity.
 class Buffer {  // 缓冲
 public:
     Buffer() :
@@ -73,11 +77,16 @@ public:
 
 private:
     Buffer& _MoveFrom(Buffer&& );
+    // reallocate block for capacity_ and move data to the front
+    void _Realloc(std::size_t dataSize);
+    std::size_t _BlockSize() const {
+        return buffer_ ? buffer_.get_deleter().size : 0;
+    }
 
     std::size_t readPos_;
     std::size_t writePos_;
     std::size_t capacity_;
-    std::unique_ptr<char []>  buffer_;
+    std::unique_ptr<char [], internal::PoolDeleter>  buffer_;
 };
 
 
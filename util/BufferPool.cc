@@ -0,0 +1,157 @@
+
+#include <vector>
+
+#include "BufferPool.h"
+
+namespace ananas {
+
+const std::size_t BufferPool::kMinClass;
+const std::size_t BufferPool::kMaxClass;
+const std::size_t BufferPool::kCacheBytesPerClass;
+
+namespace {
+
+const int kMinShift = 8;  // 256
+const int kMaxShift = 20; // 1M
+const int kClasses = kMaxShift - kMinShift + 1;
+
+// size must be in [kMinClass, kMaxClass]
+int ClassIndex(std::size_t size) {
+    int index = 0;
+    std::size_t cls = BufferPool::kMinClass;
+    while (cls < size) {
+        cls <<= 1;
+        ++ index;
+    }
+
+    return index;
+}
+
+class ThreadCache {
+public:
+    ThreadCache() {
+        static_assert(BufferPool::kMinClass == (1 << kMinShift), "Bad min class");
+        static_assert(BufferPool::kMaxClass == (1 << kMaxShift), "Bad max class");
+    }
+
+    ~ThreadCache();
+
+    char* Allocate(std::size_t& size);
+    void Deallocate(char* block, std::size_t size);
+    void Trim();
+
+    BufferPoolStats stats;
+
+private:
+    std::vector<char*> free_[kClasses];
+};
+
+// Buffers may be freed after ThreadCache is destroyed at thread exit,
+// this flag has no destructor, it's always safe to read.
+thread_local bool t_destroyed = false;
+
+ThreadCache& Cache() {
+    thread_local ThreadCache cache;
+    return cache;
+}
+
+ThreadCache::~ThreadCache() {
+    Trim();
+    t_destroyed = true;
+}
+
+char* ThreadCache::Allocate(std::size_t& size) {
+    ++ stats.allocs;
+
+    if (size > BufferPool::kMaxClass)
+        return new char[size];
+
+    if (size < BufferPool::kMinClass)
+        size = BufferPool::kMinClass;
+
+    const int index = ClassIndex(size);
+    size = BufferPool::kMinClass << index;
+
+    auto& list = free_[index];
+    if (list.empty())
+        return new char[size];
+
+    ++ stats.hits;
+    stats.cachedBytes -= size;
+
+    char* block = list.back();
+    list.pop_back();
+    return block;
+}
+
+void ThreadCache::Deallocate(char* block, std::size_t size) {
+    ++ stats.frees;
+
+    if (size < BufferPool::kMinClass || size > BufferPool::kMaxClass) {
+        delete [] block;
+        return;
+    }
+
+    // not from free list, eg. allocated after thread cache destroyed
+    const int index = ClassIndex(size);
+    if ((BufferPool::kMinClass << index) != size) {
+        delete [] block;
+        return;
+    }
+
+    auto& list = free_[index];
+    if (list.size() * size >= BufferPool::kCacheBytesPerClass && !list.empty()) {
+        delete [] block;
+        return;
+    }
+
+    ++ stats.cached;
+    stats.cachedBytes += size;
+    list.push_back(block);
+}
+
+void ThreadCache::Trim() {
+    for (auto& list : free_) {
+        for (char* block : list)
+            delete [] block;
+
+        list.clear();
+        list.shrink_to_fit();
+    }
+
+    stats.cachedBytes = 0;
+}
+
+} // end namespace
+
+char* BufferPool::Allocate(std::size_t& size) {
+    if (t_destroyed)
+        return new char[size];
+
+    return Cache().Allocate(size);
+}
+
+void BufferPool::Deallocate(char* block, std::size_t size) {
+    if (t_destroyed) {
+        delete [] block;
+        return;
+    }
+
+    Cache().Deallocate(block, size);
+}
+
+const BufferPoolStats& BufferPool::ThreadStats() {
+    static const BufferPoolStats kEmpty;
+    if (t_destroyed)
+        return kEmpty;
+
+    return Cache().stats;
+}
+
+void BufferPool::Trim() {
+    if (!t_destroyed)
+        Cache().Trim();
+}
+
+} // namespace ananas
+
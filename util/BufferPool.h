@@ -0,0 +1,66 @@
+#ifndef BERT_BUFFERPOOL_H
+#define BERT_BUFFERPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+///@file BufferPool.h
+namespace ananas {
+
+///@brief Counters of the buffer pool of one thread
+struct BufferPoolStats {
+    uint64_t allocs {0};    // all allocations
+    uint64_t hits {0};      // allocations served by free list
+    uint64_t frees {0};     // all deallocations
+    uint64_t cached {0};    // deallocations kept in free list
+    std::size_t cachedBytes {0};
+
+    double HitRate() const {
+        return allocs == 0 ? 0.0 : static_cast<double>(hits) / allocs;
+    }
+};
+
+///@brief Thread-local size-class allocator for Buffer and IOBuf
+///
+/// Sizes are rounded up to power of two classes, from kMinClass to kMaxClass.
+/// Each thread keeps free lists of its own, so no lock is needed. Memory freed
+/// by other thread goes to that thread's list. Bigger sizes go to new/delete.
+class BufferPool {
+public:
+    static const std::size_t kMinClass = 256;
+    static const std::size_t kMaxClass = 1024 * 1024;
+    // free list of each class keeps at most this many bytes
+    static const std::size_t kCacheBytesPerClass = 1024 * 1024;
+
+    ///@brief Allocate at least size bytes
+    ///@param size In: bytes wanted; Out: real size of the block
+    static char* Allocate(std::size_t& size);
+    ///@brief Give back block got from Allocate, size is the real size
+    static void Deallocate(char* block, std::size_t size);
+
+    ///@brief Counters of calling thread
+    static const BufferPoolStats& ThreadStats();
+    ///@brief Release cached memory of calling thread
+    static void Trim();
+};
+
+namespace internal {
+
+// for unique_ptr & shared_ptr
+struct PoolDeleter {
+    std::size_t size {0};
+
+    PoolDeleter() = default;
+    explicit PoolDeleter(std::size_t s) : size(s) { }
+
+    void operator()(char* block) const {
+        if (block)
+            BufferPool::Deallocate(block, size);
+    }
+};
+
+} // namespace internal
+} // namespace ananas
+
+#endif
+
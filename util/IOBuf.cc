@@ -0,0 +1,340 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "IOBuf.h"
+
+namespace ananas {
+
+const std::size_t IOBuf::kBlockSize = 4 * 1024;
+
+IOBuf::IOBuf(const void* data, std::size_t len) {
+    Append(data, len);
+}
+
+IOBuf::IOBuf(Buffer&& buf) {
+    Append(std::move(buf));
+}
+
+IOBuf::IOBuf(std::string&& str) {
+    Append(std::move(str));
+}
+
+IOBuf::IOBuf(IOBuf&& other) :
+    segments_(std::move(other.segments_)),
+    size_(other.size_) {
+    other.Clear();
+}
+
+IOBuf& IOBuf::operator= (IOBuf&& other) {
+    if (this != &other) {
+        segments_ = std::move(other.segments_);
+        size_ = other.size_;
+        other.Clear();
+    }
+
+    return *this;
+}
+
+IOBuf IOBuf::WithHeadroom(std::size_t headroom, std::size_t capacity) {
+    Segment seg = _NewBlock(headroom + capacity);
+    seg.data = seg.begin + headroom;
+
+    IOBuf buf;
+    buf.segments_.push_back(std::move(seg));
+    return buf;
+}
+
+IOBuf::Segment IOBuf::_NewBlock(std::size_t size) {
+    size = std::max(size, kBlockSize);
+    char* block = BufferPool::Allocate(size);
+
+    Segment seg;
+    seg.block.reset(block, internal::PoolDeleter(size));
+    seg.begin = seg.block.get();
+    seg.end = seg.begin + size;
+    seg.data = seg.begin;
+    seg.len = 0;
+    seg.owned = true;
+    return seg;
+}
+
+void IOBuf::_Push(Segment&& seg) {
+    if (seg.len == 0)
+        return;
+
+    // drop the empty block reserved by WithHeadroom
+    if (!segments_.empty() && segments_.back().len == 0)
+        segments_.pop_back();
+
+    size_ += seg.len;
+    segments_.push_back(std::move(seg));
+}
+
+void IOBuf::Append(const void* data, std::size_t len) {
+    if (!data || len == 0)
+        return;
+
+    const char* src = static_cast<const char*>(data);
+    if (!segments_.empty()) {
+        Segment& last = segments_.back();
+        if (last.Writable() && last.Tailroom() > 0) {
+            const std::size_t n = std::min(len, last.Tailroom());
+            ::memcpy(last.data + last.len, src, n);
+            last.len += n;
+            size_ += n;
+
+            src += n;
+            len -= n;
+            if (len == 0)
+                return;
+        }
+    }
+
+    Segment seg = _NewBlock(len);
+    ::memcpy(seg.data, src, len);
+    seg.len = len;
+    _Push(std::move(seg));
+}
+
+void IOBuf::Append(const IOBuf& other) {
+    if (&other == this) {
+        IOBuf copy(other);
+        Append(std::move(copy));
+        return;
+    }
+
+    for (const auto& seg : other.segments_) {
+        Segment copy(seg);
+        _Push(std::move(copy));
+    }
+}
+
+void IOBuf::Append(IOBuf&& other) {
+    if (&other == this) {
+        Append(static_cast<const IOBuf&>(other));
+        return;
+    }
+
+    if (Empty()) {
+        *this = std::move(other);
+        return;
+    }
+
+    for (auto& seg : other.segments_)
+        _Push(std::move(seg));
+
+    other.Clear();
+}
+
+void IOBuf::Append(Buffer&& buf) {
+    if (buf.IsEmpty())
+        return;
+
+    // keep Buffer alive by the block, alias to its data
+    auto owner = std::make_shared<Buffer>(std::move(buf));
+
+    Segment seg;
+    seg.data = owner->ReadAddr();
+    seg.len = owner->ReadableSize();
+    seg.begin = seg.data;
+    seg.end = seg.data + seg.len;
+    seg.block = std::shared_ptr<char>(owner, seg.data);
+    _Push(std::move(seg));
+}
+
+void IOBuf::Append(std::string&& str) {
+    if (str.empty())
+        return;
+
+    auto owner = std::make_shared<std::string>(std::move(str));
+
+    Segment seg;
+    seg.data = &(*owner)[0];
+    seg.len = owner->size();
+    seg.begin = seg.data;
+    seg.end = seg.data + seg.len;
+    seg.block = std::shared_ptr<char>(owner, seg.data);
+    _Push(std::move(seg));
+}
+
+void IOBuf::Prepend(const void* data, std::size_t len) {
+    if (!data || len == 0)
+        return;
+
+    const char* src = static_cast<const char*>(data);
+    if (!segments_.empty()) {
+        Segment& first = segments_.front();
+        if (first.Writable() && first.Headroom() >= len) {
+            first.data -= len;
+            first.len += len;
+            ::memcpy(first.data, src, len);
+            size_ += len;
+            return;
+        }
+    }
+
+    // put data at the end of new block, so next Prepend may fit
+    Segment seg = _NewBlock(len);
+    seg.data = seg.end - len;
+    seg.len = len;
+    ::memcpy(seg.data, src, len);
+
+    size_ += len;
+    segments_.push_front(std::move(seg));
+}
+
+char* IOBuf::AppendSpace(std::size_t len) {
+    if (!segments_.empty()) {
+        Segment& last = segments_.back();
+        if (last.Writable() && last.Tailroom() >= len)
+            return last.data + last.len;
+    }
+
+    // reserve an empty block, it's dropped by _Push if not used
+    Segment seg = _NewBlock(len);
+    if (!segments_.empty() && segments_.back().len == 0)
+        segments_.pop_back();
+
+    segments_.push_back(std::move(seg));
+    return segments_.back().data;
+}
+
+void IOBuf::Produce(std::size_t len) {
+    assert (!segments_.empty());
+
+    Segment& last = segments_.back();
+    assert (last.Writable() && last.Tailroom() >= len);
+    last.len += len;
+    size_ += len;
+}
+
+void IOBuf::TrimStart(std::size_t len) {
+    assert (len <= size_);
+    if (len == 0)
+        return;
+
+    len = std::min(len, size_);
+    size_ -= len;
+
+    while (len > 0) {
+        Segment& first = segments_.front();
+        if (len < first.len) {
+            first.data += len;
+            first.len -= len;
+            return;
+        }
+
+        len -= first.len;
+        segments_.pop_front();
+    }
+
+    // drop empty reserved block too
+    if (size_ == 0)
+        segments_.clear();
+}
+
+void IOBuf::TrimEnd(std::size_t len) {
+    assert (len <= size_);
+    if (len == 0)
+        return;
+
+    len = std::min(len, size_);
+    size_ -= len;
+
+    while (len > 0) {
+        Segment& last = segments_.back();
+        if (len < last.len) {
+            last.len -= len;
+            return;
+        }
+
+        len -= last.len;
+        segments_.pop_back();
+    }
+
+    if (size_ == 0)
+        segments_.clear();
+}
+
+void IOBuf::Clear() {
+    segments_.clear();
+    size_ = 0;
+}
+
+IOBuf IOBuf::Slice(std::size_t offset, std::size_t len) const {
+    IOBuf result;
+    if (offset >= size_ || len == 0)
+        return result;
+
+    len = std::min(len, size_ - offset);
+    for (const auto& seg : segments_) {
+        if (len == 0)
+            break;
+
+        if (offset >= seg.len) {
+            offset -= seg.len;
+            continue;
+        }
+
+        Segment copy(seg);
+        copy.data += offset;
+        copy.len = std::min(seg.len - offset, len);
+        offset = 0;
+        len -= copy.len;
+
+        result._Push(std::move(copy));
+    }
+
+    return result;
+}
+
+std::size_t IOBuf::ToIovec(iovec* iov, std::size_t maxIov) const {
+    std::size_t n = 0;
+    for (const auto& seg : segments_) {
+        if (n == maxIov)
+            break;
+
+        if (seg.len == 0)
+            continue;
+
+        iov[n].iov_base = seg.data;
+        iov[n].iov_len = seg.len;
+        ++ n;
+    }
+
+    return n;
+}
+
+std::size_t IOBuf::CopyTo(void* dst, std::size_t len, std::size_t offset) const {
+    char* out = static_cast<char*>(dst);
+    std::size_t copied = 0;
+    for (const auto& seg : segments_) {
+        if (copied == len)
+            break;
+
+        if (offset >= seg.len) {
+            offset -= seg.len;
+            continue;
+        }
+
+        const std::size_t n = std::min(seg.len - offset, len - copied);
+        ::memcpy(out + copied, seg.data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+std::string IOBuf::ToString() const {
+    std::string str(size_, '\0');
+    if (size_ > 0)
+        CopyTo(&str[0], size_);
+
+    return str;
+}
+
+} // namespace ananas
+
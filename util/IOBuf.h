@@ -0,0 +1,115 @@
+#ifndef BERT_IOBUF_H
+#define BERT_IOBUF_H
+
+#include <sys/uio.h>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "Buffer.h"
+
+///@file IOBuf.h
+namespace ananas {
+
+///@brief Reference counted chain of memory blocks
+///
+/// Copy, Slice and Append(IOBuf) share blocks instead of copying bytes.
+/// Buffer and std::string can be taken over without copy.
+/// Raw data is copied into the tail room of last block if the block is
+/// not shared, otherwise a new block is allocated.
+/// Like Buffer, it's not thread safe, but blocks can be shared by IOBufs
+/// in different threads as long as they're read only.
+class IOBuf {
+public:
+    IOBuf() = default;
+    IOBuf(const void* data, std::size_t len);
+    explicit IOBuf(Buffer&& buf);
+    explicit IOBuf(std::string&& str);
+
+    IOBuf(const IOBuf& ) = default;
+    IOBuf& operator= (const IOBuf& ) = default;
+    IOBuf(IOBuf&& other);
+    IOBuf& operator= (IOBuf&& other);
+
+    ///@brief Create empty IOBuf, reserve headroom for Prepend
+    static IOBuf WithHeadroom(std::size_t headroom, std::size_t capacity = 0);
+
+    ///@brief Total bytes
+    std::size_t Size() const {
+        return size_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+    std::size_t SegmentCount() const {
+        return segments_.size();
+    }
+
+    ///@brief Copy data to the end
+    void Append(const void* data, std::size_t len);
+    ///@brief Share blocks of other
+    void Append(const IOBuf& other);
+    void Append(IOBuf&& other);
+    ///@brief Take over memory, no copy
+    void Append(Buffer&& buf);
+    void Append(std::string&& str);
+
+    ///@brief Copy data to the front, use headroom if possible
+    void Prepend(const void* data, std::size_t len);
+
+    ///@brief Get a contiguous writable area at the end
+    ///
+    /// Call Produce after filled, like Buffer::WriteAddr
+    char* AppendSpace(std::size_t len);
+    void Produce(std::size_t len);
+
+    ///@brief Drop bytes from the front
+    void TrimStart(std::size_t len);
+    ///@brief Drop bytes from the end
+    void TrimEnd(std::size_t len);
+    void Clear();
+
+    ///@brief Share [offset, offset + len), no copy
+    IOBuf Slice(std::size_t offset, std::size_t len) const;
+
+    ///@brief Export segments from front for writev
+    ///@return Count of iovec filled
+    std::size_t ToIovec(iovec* iov, std::size_t maxIov) const;
+
+    ///@brief Copy bytes out, return bytes copied
+    std::size_t CopyTo(void* dst, std::size_t len, std::size_t offset = 0) const;
+    std::string ToString() const;
+
+    static const std::size_t kBlockSize;
+
+private:
+    struct Segment {
+        std::shared_ptr<char> block;    // owns the memory, may be an alias
+        char* begin {nullptr};          // [begin, end) of block
+        char* end {nullptr};
+        char* data {nullptr};           // [data, data + len) is valid
+        std::size_t len {0};
+        bool owned {false};             // allocated by me, spare room is usable
+
+        bool Writable() const {
+            return owned && block.use_count() == 1;
+        }
+        std::size_t Headroom() const {
+            return static_cast<std::size_t>(data - begin);
+        }
+        std::size_t Tailroom() const {
+            return static_cast<std::size_t>(end - (data + len));
+        }
+    };
+
+    static Segment _NewBlock(std::size_t size);
+    void _Push(Segment&& seg);
+
+    std::deque<Segment> segments_;
+    std::size_t size_ {0};
+};
+
+} // namespace ananas
+
+#endif
+
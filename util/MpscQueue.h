@@ -0,0 +1,110 @@
+#ifndef BERT_MPSCQUEUE_H
+#define BERT_MPSCQUEUE_H
+
+#include <atomic>
+#include <type_traits>
+
+///@file MpscQueue.h
+///@brief Intrusive lock-free multi-producer single-consumer queue
+///Usage:
+///@code
+/// struct Task : public ananas::MpscNode {
+///     std::function<void ()> func;
+/// };
+///
+/// ananas::MpscQueue<Task> queue;
+/// // any thread
+/// queue.Push(new Task(...));
+/// // only the consumer thread
+/// while (Task* t = queue.Pop()) {
+///     t->func();
+///     delete t;
+/// }
+///@endcode
+namespace ananas {
+
+///@brief Derive your node from it
+struct MpscNode {
+    std::atomic<MpscNode*> next_ {nullptr};
+};
+
+///@brief Dmitry Vyukov's intrusive MPSC queue
+///
+/// Push is wait-free and can be called by any thread.
+/// Pop can only be called by one consumer thread, it may return nullptr
+/// while a producer is in the middle of Push, that producer must do
+/// something to notify consumer, see EventLoop.
+/// The queue does not own nodes.
+template <typename T>
+class MpscQueue final {
+    static_assert(std::is_base_of<MpscNode, T>::value, "T must derive from MpscNode");
+public:
+    MpscQueue() :
+        head_(&stub_),
+        tail_(&stub_) {
+    }
+
+    MpscQueue(const MpscQueue& ) = delete;
+    void operator= (const MpscQueue& ) = delete;
+
+    void Push(T* node) {
+        _Push(node);
+    }
+
+    T* Pop() {
+        MpscNode* tail = tail_;
+        MpscNode* next = tail->next_.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (!next)
+                return nullptr;
+
+            // skip stub
+            tail_ = next;
+            tail = next;
+            next = next->next_.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+            tail_ = next;
+            return static_cast<T*>(tail);
+        }
+
+        if (tail != head_.load(std::memory_order_acquire))
+            return nullptr; // a producer is pushing
+
+        // tail is the last one, push stub back so tail can be popped
+        _Push(&stub_);
+
+        next = tail->next_.load(std::memory_order_acquire);
+        if (next) {
+            tail_ = next;
+            return static_cast<T*>(tail);
+        }
+
+        return nullptr;
+    }
+
+    ///@brief Only for consumer thread
+    bool Empty() const {
+        return tail_ == &stub_ &&
+               stub_.next_.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    void _Push(MpscNode* node) {
+        node->next_.store(nullptr, std::memory_order_relaxed);
+        MpscNode* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next_.store(node, std::memory_order_release);
+    }
+
+    // producers and consumer write different cache lines
+    std::atomic<MpscNode*> head_;
+    char padding_[64];
+    MpscNode* tail_;
+    MpscNode stub_;
+};
+
+} // namespace ananas
+
+#endif
+
@@ -1,5 +1,6 @@
 #include <cassert>
 #include "ThreadPool.h"
+#include "Affinity.h"
 
 namespace ananas {
 std::thread::id ThreadPool::s_mainThread;
@@ -18,6 +19,12 @@ void ThreadPool::SetNumOfThreads(int n) {
     numThreads_ = n;
 }
 
+void ThreadPool::SetCpuAffinity(std::vector<int> cpus) {
+    std::unique_lock<std::mutex> guard(mutex_);
+    assert (workers_.empty());
+    cpus_ = std::move(cpus);
+}
+
 void ThreadPool::_Start() {
   if (shutdown_) {
     return;
@@ -26,7 +33,14 @@ void ThreadPool::_Start() {
   assert(workers_.empty());
 
   for (int i = 0; i < numThreads_; i++) {
-    std::thread t([this]() { this->_WorkerRoutine(); });    // 线程执行this->_WorkerRoutine()函数
+    const int cpu = cpus_.empty() ? -1 : cpus_[i % cpus_.size()];
+    std::thread t([this, cpu]() {
+        // pin before running any task, so memory is allocated locally
+        if (cpu >= 0 && SetThreadAffinity(cpu))
+            SetLocalMemPolicy();
+
+        this->_WorkerRoutine(); // 线程执行this->_WorkerRoutine()函数
+    });
     workers_.push_back(std::move(t));   // 创建线程并将线程放入到workers_中
   }
 }
@@ -2,6 +2,7 @@
 #define BERT_THREADPOOL_H
 
 #include <deque>
+#include <vector>
 #include <thread>
 #include <memory>
 #include <mutex>
@@ -69,6 +70,12 @@ public:
     /// Default value is 1
     void SetNumOfThreads(int );
 
+    ///@brief Pin threads to cpus, must be called before first Execute
+    ///
+    /// The i-th thread runs on cpus[i % cpus.size()], and allocates
+    /// memory from local NUMA node. Empty cpus means no pinning.
+    void SetCpuAffinity(std::vector<int> cpus);
+
     // ---- below are for unittest ----
     // num of workers
     size_t WorkerThreads() const;
@@ -80,6 +87,7 @@ private:
     void _Start();
 
     int numThreads_ {1};
+    std::vector<int> cpus_;
     std::deque<std::thread> workers_;
 
     mutable std::mutex mutex_;
@@ -1,117 +1,360 @@
-#include <vector>
+
+#include <algorithm>
 #include <cassert>
 #include "Timer.h"
 
 namespace ananas {
 namespace internal {
 
-unsigned int TimerManager::s_timerIdGen_ = 0;
+constexpr uint32_t TimerManager::kNil;
+const int TimerManager::kL0Bits;
+const int TimerManager::kLnBits;
+const int TimerManager::kLevels;
+const std::chrono::steady_clock::duration TimerManager::kTick = std::chrono::milliseconds(1);
+
+namespace {
+const uint64_t kL0Mask = (1 << 8) - 1;
+const uint64_t kLnMask = (1 << 6) - 1;
+}
 
 TimerManager::TimerManager() {
+    static_assert(kL0Mask + 1 == 1 << kL0Bits && kLnMask + 1 == 1 << kLnBits, "Bad mask");
+
+    wheel0_.fill(kNil);
+    for (auto& wheel : wheelN_)
+        wheel.fill(kNil);
+    levelCount_.fill(0);
+
+    wheelBase_ = std::chrono::steady_clock::now();
 }
 
 TimerManager::~TimerManager() {
 }
 
+bool TimerManager::SetMode(TimerMode mode) {
+    if (size_ != 0)
+        return false;
+
+    mode_ = mode;
+    return true;
+}
+
 void TimerManager::Update() {
-    if (timers_.empty())
+    if (size_ == 0)
         return;
 
     const auto now = std::chrono::steady_clock::now();
 
-    for (auto it(timers_.begin()); it != timers_.end(); ) {
+    if (mode_ == TimerMode::eTM_Wheel) {
+        _UpdateWheel(now);
+        return;
+    }
+
+    while (!timers_.empty()) {
+        auto it = timers_.begin();
         if (it->first > now)
             return;
 
+        const uint32_t index = it->second;
+        timers_.erase(it);
+
         // support cancel self
-        it->second.OnTimer();
-
-        // steal and erase it
-        Timer timer(std::move(it->second));
-        it = timers_.erase(it);
-
-        if (timer.count_ != 0) {
-            // need reschedule
-            const auto tp = timer.id_->first;
-            auto itNew = timers_.insert(std::make_pair(tp, std::move(timer)));  // 插入到定时器
-            if (it == timers_.end() || itNew->first < it->first)
-                it = itNew;
-        }
+        records_[index].state = State::eS_Firing;
+        _Fire(index);
     }
 }
 
 bool TimerManager::Cancel(TimerId id) {
-    //time point + uid
-    auto begin = timers_.lower_bound(id->first);
-    if (begin == timers_.end())
+    Record* r = _GetRecord(id);
+    if (!r)
         return false;
 
-    auto end = timers_.upper_bound(id->first);
-    for (auto it(begin); it != end; ++ it) {
-        if (it->second.UniqueId() == id->second) {
-            // lazy delete, in case cancel another timer during on timer call.
-            it->second.count_ = 0;
-            return true;
-        }
+    if (r->state == State::eS_Firing) {
+        // it's in callback now, free it after callback returns
+        r->count = 0;
+        return true;
     }
 
-    return false;
+    _Unlink(id.index_);
+    _FreeRecord(id.index_);
+    return true;
 }
 
 DurationMs TimerManager::NearestTimer() const {
-    if (timers_.empty())
+    const TimePoint nearest = NearestDeadline();
+    if (nearest == TimePoint::max())
         return DurationMs::max();
 
-    const auto& timer = timers_.begin()->second;
     auto now = std::chrono::steady_clock::now();
-    if (now > timer.Id()->first)
+    if (now > nearest)
         return DurationMs::min();
     else
-        return std::chrono::duration_cast<DurationMs>(timer.Id()->first - now);
+        return std::chrono::duration_cast<DurationMs>(nearest - now);
+}
+
+TimePoint TimerManager::NearestDeadline() const {
+    if (size_ == 0)
+        return TimePoint::max();
+
+    if (mode_ == TimerMode::eTM_Wheel) {
+        // Timers of higher levels are cascaded at next boundary of level 0,
+        // so the nearest is not later than it.
+        // If currentTick_ is a boundary, the cascade is pending.
+        const uint64_t boundary = (currentTick_ + kL0Mask) & ~kL0Mask;
+        uint64_t tick = currentTick_;
+        if (levelCount_[0] > 0) {
+            while (tick < boundary && wheel0_[tick & kL0Mask] == kNil)
+                ++ tick;
+        } else {
+            tick = boundary;
+        }
+
+        return _FromTick(tick);
+    }
+
+    if (timers_.empty())
+        return TimePoint::max();
+
+    return timers_.begin()->first;
+}
+
+uint32_t TimerManager::_NewRecord() {
+    uint32_t index;
+    if (!freeRecords_.empty()) {
+        index = freeRecords_.back();
+        freeRecords_.pop_back();
+    } else {
+        index = static_cast<uint32_t>(records_.size());
+        records_.emplace_back();
+    }
+
+    if (++ timerIdGen_ == 0) // wrap around, 0 is invalid
+        ++ timerIdGen_;
+
+    Record& r = records_[index];
+    r.uid = timerIdGen_;
+    ++ size_;
+
+    return index;
 }
 
-TimerManager::Timer::Timer(const TimePoint& tp) :
-    id_(std::make_shared<std::pair<TimePoint, unsigned int>>(tp, ++ TimerManager::s_timerIdGen_)),
-    count_(kForever) {
+void TimerManager::_FreeRecord(uint32_t index) {
+    Record& r = records_[index];
+    assert (r.state != State::eS_Free);
+
+    r.state = State::eS_Free;
+    r.uid = 0;
+    r.count = 0;
+    -- size_;
+
+    freeRecords_.push_back(index);
+
+    // destruct callback at last, it may schedule or cancel timer
+    std::function<void ()> func;
+    func.swap(r.func);
 }
 
-TimerManager::Timer::Timer(Timer&& timer) {
-    _Move(std::move(timer));
+TimerManager::Record* TimerManager::_GetRecord(const TimerId& id) {
+    if (!id || id.index_ >= records_.size())
+        return nullptr;
+
+    Record& r = records_[id.index_];
+    if (r.state == State::eS_Free || r.uid != id.uid_)
+        return nullptr;
+
+    return &r;
 }
 
-TimerManager::Timer& TimerManager::Timer::operator= (Timer&& timer) {
-    if (this != &timer)
-        _Move(std::move(timer));
+void TimerManager::_Link(uint32_t index) {
+    Record& r = records_[index];
+    r.state = State::eS_Linked;
 
-    return *this;
+    if (mode_ == TimerMode::eTM_Wheel)
+        _WheelAdd(index);
+    else
+        r.pos = timers_.insert(std::make_pair(r.when, index));  // 插入到定时器
 }
 
-void TimerManager::Timer::_Move(Timer&& timer) {
-    this->id_ = std::move(timer.id_);
-    this->func_ = std::move(timer.func_);
-    this->interval_ = std::move(timer.interval_);
-    this->count_ = timer.count_;
+void TimerManager::_Unlink(uint32_t index) {
+    Record& r = records_[index];
+    assert (r.state == State::eS_Linked);
+
+    if (mode_ == TimerMode::eTM_Wheel)
+        _WheelRemove(index);
+    else
+        timers_.erase(r.pos);
+
+    r.state = State::eS_Firing;
 }
 
+void TimerManager::_Fire(uint32_t index) {
+    // records_ is a deque, r is valid even if callback add timers
+    Record& r = records_[index];
+    assert (r.state == State::eS_Firing);
 
-void TimerManager::Timer::OnTimer() {
-    if (!func_ || count_ == 0)
-        return;
+    if (r.count == kForever || r.count-- > 0)
+        r.func();
 
-    if (count_ == kForever || count_-- > 0) {
-        func_();
-        id_->first += interval_;
+    if (r.count != 0) {
+        // need reschedule
+        r.when += r.interval;
+        _Link(index);
     } else {
-        count_ = 0; // in case if count_ other than -1
+        _FreeRecord(index);
     }
 }
 
-TimerId TimerManager::Timer::Id() const {
-    return id_;
+uint64_t TimerManager::_ToTick(const TimePoint& tp) const {
+    if (tp <= wheelBase_)
+        return 0;
+
+    // round up, never trigger earlier
+    const auto d = (tp - wheelBase_).count();
+    return static_cast<uint64_t>((d + kTick.count() - 1) / kTick.count());
 }
 
-unsigned int TimerManager::Timer::UniqueId() const {
-    return id_->second;
+TimePoint TimerManager::_FromTick(uint64_t tick) const {
+    return wheelBase_ + kTick * tick;
+}
+
+void TimerManager::_WheelAdd(uint32_t index) {
+    if (std::all_of(levelCount_.begin(), levelCount_.end(),
+                    [](std::size_t n) { return n == 0; })) {
+        // wheel is empty, skip the idle ticks
+        const auto now = std::chrono::steady_clock::now();
+        const auto nowTick = static_cast<uint64_t>((now - wheelBase_) / kTick);
+        currentTick_ = std::max(currentTick_, nowTick + 1);
+    }
+
+    Record& r = records_[index];
+    r.expireTick = _ToTick(r.when);
+
+    uint64_t expire = std::max(r.expireTick, currentTick_);
+    const uint64_t delta = expire - currentTick_;
+
+    int level = 0;
+    uint32_t* head = nullptr;
+    if (delta <= kL0Mask) {
+        head = &wheel0_[expire & kL0Mask];
+    } else {
+        for (level = 1; level < kLevels; ++ level) {
+            if (delta < (static_cast<uint64_t>(1) << (kL0Bits + level * kLnBits)))
+                break;
+        }
+
+        if (level == kLevels) {
+            // too far, put it at the end, it'll be cascaded again
+            level = kLevels - 1;
+            expire = currentTick_ + (static_cast<uint64_t>(1) << (kL0Bits + level * kLnBits)) - 1;
+        }
+
+        const int shift = kL0Bits + (level - 1) * kLnBits;
+        head = &wheelN_[level - 1][(expire >> shift) & kLnMask];
+    }
+
+    r.level = level;
+    r.head = head;
+    r.prev = kNil;
+    r.next = *head;
+    if (*head != kNil)
+        records_[*head].prev = index;
+    *head = index;
+
+    ++ levelCount_[level];
+}
+
+void TimerManager::_WheelRemove(uint32_t index) {
+    Record& r = records_[index];
+    if (r.prev != kNil)
+        records_[r.prev].next = r.next;
+    else
+        *r.head = r.next;
+
+    if (r.next != kNil)
+        records_[r.next].prev = r.prev;
+
+    if (r.level < kLevels)
+        -- levelCount_[r.level];
+
+    r.head = nullptr;
+    r.prev = r.next = kNil;
+}
+
+void TimerManager::_Cascade(uint32_t* head) {
+    uint32_t index = *head;
+    *head = kNil;
+
+    while (index != kNil) {
+        Record& r = records_[index];
+        const uint32_t next = r.next;
+        const int level = r.level;
+
+        // add before decrease count, or the wheel may look like empty
+        _WheelAdd(index);
+        -- levelCount_[level];
+
+        index = next;
+    }
+}
+
+void TimerManager::_UpdateWheel(const TimePoint& now) {
+    const uint64_t nowTick = now < wheelBase_ ? 0 :
+                             static_cast<uint64_t>((now - wheelBase_) / kTick);
+
+    while (currentTick_ <= nowTick) {
+        const uint64_t tick = currentTick_;
+        if ((tick & kL0Mask) == 0) {
+            // higher level first, they may cascade into lower level
+            const uint64_t i1 = (tick >> kL0Bits) & kLnMask;
+            if (i1 == 0) {
+                const uint64_t i2 = (tick >> (kL0Bits + kLnBits)) & kLnMask;
+                if (i2 == 0)
+                    _Cascade(&wheelN_[2][(tick >> (kL0Bits + 2 * kLnBits)) & kLnMask]);
+
+                _Cascade(&wheelN_[1][i2]);
+            }
+
+            _Cascade(&wheelN_[0][i1]);
+        }
+
+        if (levelCount_[0] == 0) {
+            if (std::all_of(levelCount_.begin(), levelCount_.end(),
+                            [](std::size_t n) { return n == 0; })) {
+                currentTick_ = nowTick + 1;
+                break;
+            }
+
+            // nothing in level 0, go to next boundary directly
+            currentTick_ = std::min((tick | kL0Mask) + 1, nowTick + 1);
+            continue;
+        }
+
+        // Timers added by callbacks will not go to this slot
+        ++ currentTick_;
+
+        uint32_t& slot = wheel0_[tick & kL0Mask];
+        if (slot == kNil)
+            continue;
+
+        // move to firing list, so cancel them in callback is O(1)
+        firing_ = slot;
+        slot = kNil;
+        for (uint32_t index = firing_; index != kNil; index = records_[index].next) {
+            Record& r = records_[index];
+            r.head = &firing_;
+            r.level = kLevels;
+            -- levelCount_[0];
+        }
+
+        while (firing_ != kNil) {
+            const uint32_t index = firing_;
+            _WheelRemove(index);
+
+            // support cancel self
+            records_[index].state = State::eS_Firing;
+            _Fire(index);
+        }
+    }
 }
 
 } // end namespace internal
@@ -1,27 +1,78 @@
-
 #ifndef BERT_TIMERMANAGER_H
 #define BERT_TIMERMANAGER_H
 
 #include <map>
+#include <array>
+#include <deque>
+#include <vector>
 #include <chrono>
 #include <functional>
 #include <memory>
 #include <ostream>
+#include <stdint.h>
 
 ///@file Timer.h
 namespace ananas {
 
 using DurationMs = std::chrono::milliseconds;
 using TimePoint = std::chrono::steady_clock::time_point;    // 时间点class
-using TimerId = std::shared_ptr<std::pair<TimePoint, unsigned int> >;
 
 constexpr int kForever = -1;
 
+namespace internal {
+class TimerManager;
+}
+
+///@brief Handle of timer, it's a cheap value type
+///
+/// A default constructed TimerId refers to no timer.
+class TimerId {
+    friend class internal::TimerManager;
+public:
+    TimerId() = default;
+
+    explicit operator bool() const {
+        return uid_ != 0;
+    }
+
+    void reset() {
+        index_ = 0;
+        uid_ = 0;
+    }
+
+    unsigned int UniqueId() const {
+        return uid_;
+    }
+
+    friend bool operator== (const TimerId& a, const TimerId& b) {
+        return a.index_ == b.index_ && a.uid_ == b.uid_;
+    }
+
+    friend bool operator!= (const TimerId& a, const TimerId& b) {
+        return !(a == b);
+    }
+
+private:
+    TimerId(uint32_t index, unsigned int uid) :
+        index_(index),
+        uid_(uid) {
+    }
+
+    uint32_t index_ {0};    // slot in TimerManager's record slab
+    unsigned int uid_ {0};  // 0 is invalid
+};
+
 inline std::ostream& operator<< (std::ostream& os, const TimerId& d) {
-    os << "[TimerId:" << (void*)d.get() << "]";
+    os << "[TimerId:" << d.UniqueId() << "]";
     return os;
 }
 
+///@brief How TimerManager organizes timers
+enum class TimerMode {
+    eTM_Default,    // ordered by trigger time, precise but O(log n)
+    eTM_Wheel,      // hierarchical timing wheel, O(1) insert & cancel, 1ms tick
+};
+
 namespace internal {
 
 ///@brief TimerManager class
@@ -35,6 +86,12 @@ public:
     TimerManager(const TimerManager& ) = delete;
     void operator= (const TimerManager& ) = delete;
 
+    ///@brief Change mode, only valid when there is no timer
+    bool SetMode(TimerMode mode);
+    TimerMode GetMode() const {
+        return mode_;
+    }
+
     // Tick
     void Update();
 
@@ -76,45 +133,81 @@ public:
     ///@brief how far the nearest timer will be trigger.
     DurationMs NearestTimer() const;
 
-private:
-    class Timer {
-        friend class TimerManager;
-    public:
-        explicit
-        Timer(const TimePoint& tp);
-
-        // only move
-        Timer(Timer&& timer);
-        Timer& operator= (Timer&& );
-
-        Timer(const Timer& ) = delete;
-        void operator= (const Timer& ) = delete;
-
-        template <typename F, typename... Args>
-        void SetCallback(F&& f, Args&&... args);
-
-        void OnTimer();
+    ///@brief when the nearest timer will be trigger, TimePoint::max() if no timer.
+    TimePoint NearestDeadline() const;
 
-        TimerId Id() const;
-        unsigned int UniqueId() const;
+    ///@brief Count of alive timers
+    std::size_t Size() const {
+        return size_;
+    }
 
-    private:
-        void _Move(Timer&& timer);
-
-        TimerId id_;
+private:
+    static constexpr uint32_t kNil = static_cast<uint32_t>(-1);
 
-        std::function<void ()> func_;
-        DurationMs interval_;
-        int count_;
+    enum class State : uint8_t {
+        eS_Free,
+        eS_Linked,  // in timers_ or wheel
+        eS_Firing,  // detached, callback is running
     };
 
-    std::multimap<TimePoint, Timer> timers_;    // 定时器, 通过multimap, 根据TimePoint时间点排序
-
-    // multimap 可以保存重复key, 不支持operator[]因为有重复key
-    friend class Timer;
+    // Timer records live in a slab, TimerId refers to them by index.
+    // deque keeps references valid when new timers are added in callback.
+    struct Record {
+        TimePoint when;
+        std::chrono::steady_clock::duration interval {0};
+        std::function<void ()> func;
+        int count {0};
+        unsigned int uid {0};
+        State state {State::eS_Free};
+
+        // eTM_Default
+        std::multimap<TimePoint, uint32_t>::iterator pos;
+
+        // eTM_Wheel: intrusive list of wheel slot
+        uint64_t expireTick {0};
+        uint32_t* head {nullptr};
+        uint32_t prev {kNil};
+        uint32_t next {kNil};
+        int level {0};
+    };
 
-    // not thread-safe, but who cares?
-    static unsigned int s_timerIdGen_;
+    uint32_t _NewRecord();
+    void _FreeRecord(uint32_t index);
+    Record* _GetRecord(const TimerId& id);
+
+    void _Link(uint32_t index);
+    void _Unlink(uint32_t index);
+    void _Fire(uint32_t index);
+
+    // timing wheel
+    uint64_t _ToTick(const TimePoint& tp) const;
+    TimePoint _FromTick(uint64_t tick) const;
+    void _WheelAdd(uint32_t index);
+    void _WheelRemove(uint32_t index);
+    void _Cascade(uint32_t* head);
+    void _UpdateWheel(const TimePoint& now);
+
+    TimerMode mode_ {TimerMode::eTM_Default};
+    std::size_t size_ {0};
+
+    std::deque<Record> records_;
+    std::vector<uint32_t> freeRecords_;
+    unsigned int timerIdGen_ {0};
+
+    std::multimap<TimePoint, uint32_t> timers_;    // 定时器, 通过multimap, 根据TimePoint时间点排序
+
+    // 256 x 1ms, then 3 levels of 64 slots, about 18 hours in all
+    static const int kL0Bits = 8;
+    static const int kLnBits = 6;
+    static const int kLevels = 4;
+    static const std::chrono::steady_clock::duration kTick;
+
+    std::array<uint32_t, 1 << kL0Bits> wheel0_;
+    std::array<std::array<uint32_t, 1 << kLnBits>, kLevels - 1> wheelN_;
+    std::array<std::size_t, kLevels> levelCount_;
+    uint32_t firing_ {kNil};    // expired timers being processed
+    TimePoint wheelBase_;
+    uint64_t currentTick_ {0};  // next tick to process
 };
 
 
@@ -124,15 +217,17 @@ TimerId TimerManager::ScheduleAtWithRepeat(const TimePoint& triggerTime, const D
 
     using namespace std::chrono;
 
-    Timer t(triggerTime);
-    // precision: milliseconds
-    t.interval_ = std::max(DurationMs(1), duration_cast<DurationMs>(period));
-    t.count_ = RepeatCount;
-    TimerId id = t.Id();
-
-    t.SetCallback(std::forward<F>(f), std::forward<Args>(args)...);
-    timers_.insert(std::make_pair(triggerTime, std::move(t)));
-    return id;
+    const uint32_t index = _NewRecord();
+    Record& r = records_[index];
+    r.when = triggerTime;
+    // precision: microseconds, but 1ms for timing wheel
+    r.interval = std::max<steady_clock::duration>(microseconds(1),
+                                                  duration_cast<steady_clock::duration>(period));
+    r.count = RepeatCount;
+    r.func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+
+    _Link(index);
+    return TimerId(index, r.uid);
 }
 
 template <int RepeatCount, typename Duration, typename F, typename... Args>
@@ -160,11 +255,6 @@ TimerId TimerManager::ScheduleAfter(const Duration& duration, F&& f, Args&&... a
                       std::forward<Args>(args)...);
 }
 
-template <typename F, typename... Args>
-void TimerManager::Timer::SetCallback(F&& f, Args&&... args) {
-    func_ = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-}
-
 } // end namespace internal
 } // end namespace ananas
 